@@ -95,6 +95,28 @@ mish_set_command_parameter(
  */
 int
 mish_cmd_poll();
+/*!
+ * Returns a file descriptor that is readable when there are 'safe' commands
+ * pending, so you can add it to your own poll()/epoll/libev loop and only
+ * call mish_cmd_poll() when it fires. Don't read or close it, mish_cmd_poll()
+ * takes care of it. Returns -1 if it can't be created.
+ */
+int
+mish_cmd_poll_fd();
+
+/*!
+ * Read metric 'name', see 'mish metric'; any thread can call this.
+ * 'count' is the number of lines that matched, 'value' the last number
+ * it captured, and 'rate' the lines per second. Returns -1 if there is
+ * no such metric. Any of the pointers can be NULL.
+ */
+int
+mish_metric_get(
+		struct mish_t * m,
+		const char * name,
+		unsigned long long * count,
+		double * value,
+		double * rate);
 
 /*
  * This is how to add a command to your program:
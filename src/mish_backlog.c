@@ -0,0 +1,502 @@
+/*
+ * mish_backlog.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "mish_priv.h"
+#include "mish_priv_backlog.h"
+
+void
+_mish_backlog_init(
+		mish_backlog_p b)
+{
+	memset(b, 0, sizeof(*b));
+	b->head = b->tail = 1;
+	b->cold.lines = MISH_BACKLOG_COLD_LINES;
+	b->cold.next = 1;
+}
+
+static mish_segment_data_p
+_mish_backlog_data_new(
+		mish_backlog_p b)
+{
+	mish_segment_data_p d = b->spare;
+	b->spare = NULL;
+	if (!d)
+		d = malloc(sizeof(*d));
+	b->alloc += sizeof(*d);
+	return d;
+}
+
+static void
+_mish_backlog_data_free(
+		mish_backlog_p b,
+		mish_segment_data_p d)
+{
+	b->alloc -= sizeof(*d);
+	if (b->spare)
+		free(d);
+	else
+		b->spare = d;
+}
+
+// uncompressed size of the segment
+static inline size_t
+_mish_segment_raw(
+		mish_segment_p s)
+{
+	return s->used + (s->count * sizeof(mish_backlog_line_t));
+}
+
+// how much memory the segment is using
+static inline size_t
+_mish_segment_alloc(
+		mish_segment_p s)
+{
+	return sizeof(*s) + (s->data ? sizeof(*s->data) : 0) + s->packed_size;
+}
+
+static inline uint32_t
+_mish_gram_hash(
+		const uint8_t * p)
+{
+	uint32_t g = (p[0] << 16) | (p[1] << 8) | p[2];
+	return (g * 2654435761u) >> (32 - MISH_BACKLOG_GRAM_BITS);
+}
+
+// add the trigrams of 'text' to the search index of the segment
+static void
+_mish_segment_grams(
+		mish_segment_p s,
+		const char * text,
+		size_t len)
+{
+	if (!s->grams)
+		return;
+	const uint8_t * p = (const uint8_t *)text;
+	for (size_t i = 0; i + 3 <= len; i++) {
+		uint32_t h = _mish_gram_hash(p + i);
+		s->grams[h / 8] |= 1 << (h % 8);
+	}
+}
+
+static void
+_mish_segment_index_free(
+		mish_backlog_p b,
+		mish_segment_p s)
+{
+	if (!s->grams)
+		return;
+	free(s->grams);
+	s->grams = NULL;
+	b->index.size -= MISH_BACKLOG_GRAM_SIZE;
+	b->index.count--;
+}
+
+/*
+ * Drop the index of the oldest segments until we're within 'max'; these
+ * are the ones we're least likely to search.
+ */
+static void
+_mish_backlog_index_trim(
+		mish_backlog_p b,
+		size_t max)
+{
+	for (int i = 0; i < b->seg_count && b->index.size > max; i++)
+		_mish_segment_index_free(b, b->seg[i]);
+}
+
+int
+_mish_backlog_index_match(
+		mish_segment_p s,
+		const char * pattern,
+		size_t len)
+{
+	if (!s->grams)
+		return 1;
+	const uint8_t * p = (const uint8_t *)pattern;
+	for (size_t i = 0; i + 3 <= len; i++) {
+		uint32_t h = _mish_gram_hash(p + i);
+		if (!(s->grams[h / 8] & (1 << (h % 8))))
+			return 0;
+	}
+	return 1;
+}
+
+static void
+_mish_segment_free(
+		mish_backlog_p b,
+		mish_segment_p s)
+{
+	_mish_segment_index_free(b, s);
+	if (s->data) {
+		if (s->packed)
+			b->cold.loaded--;
+		_mish_backlog_data_free(b, s->data);
+	}
+	if (s->packed) {
+		b->alloc -= s->packed_size;
+		b->cold.raw -= _mish_segment_raw(s);
+		b->cold.packed -= s->packed_size;
+		free(s->packed);
+	}
+	b->alloc -= sizeof(*s);
+	b->bytes -= _mish_segment_raw(s);
+	free(s);
+}
+
+void
+_mish_backlog_dispose(
+		mish_backlog_p b)
+{
+	for (int i = 0; i < b->seg_count; i++)
+		_mish_segment_free(b, b->seg[i]);
+	free(b->seg);
+	free(b->spare);
+	_mish_backlog_init(b);
+}
+
+static mish_segment_p
+_mish_backlog_new_segment(
+		mish_backlog_p b)
+{
+	mish_segment_p s = calloc(1, sizeof(*s));
+	s->first = b->tail;
+	s->data = _mish_backlog_data_new(b);
+	if (b->seg_count == b->seg_size) {
+		b->seg_size += 16;
+		b->seg = realloc(b->seg, b->seg_size * sizeof(b->seg[0]));
+	}
+	b->seg[b->seg_count++] = s;
+	b->alloc += sizeof(*s);
+	if (b->index.max) {
+		_mish_backlog_index_trim(b, b->index.max > MISH_BACKLOG_GRAM_SIZE ?
+				b->index.max - MISH_BACKLOG_GRAM_SIZE : 0);
+		if (b->index.max >= MISH_BACKLOG_GRAM_SIZE) {
+			s->grams = calloc(1, MISH_BACKLOG_GRAM_SIZE);
+			b->index.size += MISH_BACKLOG_GRAM_SIZE;
+			b->index.count++;
+		}
+	}
+	return s;
+}
+
+uint64_t
+_mish_backlog_add(
+		mish_backlog_p b,
+		const char * text,
+		size_t len,
+		uint16_t flags)
+{
+	mish_segment_p s = b->seg_count ? b->seg[b->seg_count - 1] : NULL;
+
+	if (!s || s->used + len >
+			sizeof(s->data->text) - ((s->count + 1) * sizeof(s->data->index[0])))
+		s = _mish_backlog_new_segment(b);
+	mish_backlog_line_p l = _mish_segment_line(s, s->count++);
+	l->offset = s->used;
+	l->len = len;
+	l->flags = flags;
+	l->stamp = s->stamp = _mish_stamp_ms();
+	/* this is done once here, so clients never have to look at the text */
+	unsigned int width = _mish_vt_display_width(text, len);
+	l->width = width > 0xffff ? 0xffff : width;
+	memcpy(s->data->text + s->used, text, len);
+	_mish_segment_grams(s, text, len);
+	s->used += len;
+	b->bytes += len + sizeof(*l);
+	b->size++;
+	return b->tail++;
+}
+
+size_t
+_mish_backlog_room(
+		mish_backlog_p b,
+		uint64_t seq)
+{
+	mish_segment_p s = b->seg_count ? b->seg[b->seg_count - 1] : NULL;
+
+	if (!s || !s->data || seq < s->first || seq < b->head || seq >= b->tail)
+		return 0;
+	uint32_t i = seq - s->first;
+	mish_backlog_line_p l = _mish_segment_line(s, i);
+	/*
+	 * The search wants the text of the lines in order, so a line that isn't
+	 * the last can't move; it can only get shorter.
+	 */
+	if (i != s->count - 1)
+		return l->len;
+	return sizeof(s->data->text) - (s->count * sizeof(s->data->index[0])) -
+				l->offset;
+}
+
+int
+_mish_backlog_replace(
+		mish_backlog_p b,
+		uint64_t seq,
+		const char * text,
+		size_t len,
+		uint16_t flags)
+{
+	size_t room = _mish_backlog_room(b, seq);
+
+	if (!room || len > room)
+		return 0;
+	mish_segment_p s = b->seg[b->seg_count - 1];
+	uint32_t i = seq - s->first;
+	mish_backlog_line_p l = _mish_segment_line(s, i);
+	if (i == s->count - 1) {
+		b->bytes = b->bytes - l->len + len;
+		s->used = l->offset + len;
+		// it's the last one, so it can be stamped when it last changed
+		l->stamp = s->stamp = _mish_stamp_ms();
+	}
+	memcpy(s->data->text + l->offset, text, len);
+	_mish_segment_grams(s, text, len);
+	l->len = len;
+	l->flags = flags;
+	unsigned int width = _mish_vt_display_width(text, len);
+	l->width = width > 0xffff ? 0xffff : width;
+	if (seq != b->replaced.seq)
+		b->replaced.since = b->replaced.gen + 1;
+	b->replaced.seq = seq;
+	b->replaced.gen++;
+	return 1;
+}
+
+/*
+ * Return the index of the segment that has line 'seq', which has to be in
+ * the backlog.
+ */
+static int
+_mish_backlog_find(
+		mish_backlog_p b,
+		uint64_t seq)
+{
+	/* most of the time, we want one of the recent lines */
+	int lo = 0, hi = b->seg_count - 1;
+	if (seq >= b->seg[hi]->first)
+		return hi;
+	hi--;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (b->seg[mid]->first <= seq)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/*
+ * Make sure the segment data is there, decompress it if it's cold.
+ */
+static int
+_mish_segment_load(
+		mish_backlog_p b,
+		mish_segment_p s)
+{
+	if (s->data) {
+		if (s->packed)
+			s->touched = ++b->cold.clock;
+		return 0;
+	}
+	mish_segment_data_p d = _mish_backlog_data_new(b);
+	size_t index = s->count * sizeof(mish_backlog_line_t);
+	if (_mish_lz_decompress(s->packed, s->packed_text,
+				d->text, s->used) != s->used ||
+			_mish_lz_decompress(s->packed + s->packed_text,
+				s->packed_size - s->packed_text,
+				&d->index[MISH_SEGMENT_INDEX_SIZE - s->count], index) != index) {
+		fprintf(stderr, "mish: %s corrupt segment %d\n", __func__,
+				(int)s->first);
+		_mish_backlog_data_free(b, d);
+		return -1;
+	}
+	s->data = d;
+	s->touched = ++b->cold.clock;
+	b->cold.loaded++;
+	return 0;
+}
+
+/*
+ * Compress the segment, and free its data; unless it doesn't compress well,
+ * in which case we leave it alone.
+ */
+static void
+_mish_segment_compress(
+		mish_backlog_p b,
+		mish_segment_p s)
+{
+	size_t raw = _mish_segment_raw(s);
+	uint8_t * p = malloc(raw);
+
+	s->cold = 1;
+	size_t t = _mish_lz_compress(s->data->text, s->used, p, raw);
+	size_t i = t ? _mish_lz_compress(_mish_segment_line(s, s->count - 1),
+						s->count * sizeof(mish_backlog_line_t),
+						p + t, raw - t) : 0;
+	// not worth it, if it doesn't save at least a quarter
+	if (!t || !i || t + i > raw - (raw / 4)) {
+		free(p);
+		return;
+	}
+	s->packed = realloc(p, t + i);
+	s->packed_size = t + i;
+	s->packed_text = t;
+	b->alloc += s->packed_size;
+	b->cold.raw += raw;
+	b->cold.packed += s->packed_size;
+	_mish_backlog_data_free(b, s->data);
+	s->data = NULL;
+}
+
+mish_backlog_line_p
+_mish_backlog_get(
+		mish_backlog_p b,
+		uint64_t seq,
+		const char ** text)
+{
+	if (seq < b->head || seq >= b->tail)
+		return NULL;
+	mish_segment_p s = b->seg[_mish_backlog_find(b, seq)];
+	if (_mish_segment_load(b, s))
+		return NULL;
+	mish_backlog_line_p l = _mish_segment_line(s, seq - s->first);
+	if (text)
+		*text = s->data->text + l->offset;
+	return l;
+}
+
+uint64_t
+_mish_backlog_find_stamp(
+		mish_backlog_p b,
+		uint64_t stamp)
+{
+	if (b->tail <= b->head)
+		return 0;
+	/* segments know the stamp of their last line, so find the first one
+	 * that ends after the stamp, then look in its index */
+	int lo = _mish_backlog_find(b, b->head), hi = b->seg_count - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (b->seg[mid]->stamp < stamp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	mish_segment_p s = b->seg[lo];
+	if (_mish_segment_load(b, s))
+		return 0;
+	uint32_t l = 0, h = s->count - 1;
+	while (l < h) {
+		uint32_t mid = (l + h) / 2;
+		if (_mish_segment_line(s, mid)->stamp < stamp)
+			l = mid + 1;
+		else
+			h = mid;
+	}
+	uint64_t seq = s->first + l;
+	return seq < b->head ? b->head : seq;
+}
+
+void
+_mish_backlog_trim(
+		mish_backlog_p b,
+		unsigned int max_lines,
+		uint64_t pin)
+{
+	if (max_lines && b->size > max_lines) {
+		b->head += b->size - max_lines;
+		b->size = max_lines;
+	}
+	/*
+	 * For the byte limit, drop as many of the oldest segments as needed, that
+	 * costs the same regardless of how many lines they had.
+	 */
+	if (b->max_bytes && b->alloc > b->max_bytes) {
+		size_t alloc = b->alloc;
+		for (int i = 0; i + 1 < b->seg_count &&
+					alloc > b->max_bytes; i++) {
+			uint64_t end = b->seg[i]->first + b->seg[i]->count;
+			if (end > b->head)
+				b->head = end;
+			alloc -= _mish_segment_alloc(b->seg[i]);
+		}
+		b->size = b->tail - b->head;
+	}
+	/*
+	 * Now free the segments that are entirely behind 'head', and not pinned.
+	 * The newest segment stays, it's the one we're adding to.
+	 */
+	uint64_t keep = pin && pin < b->head ? pin : b->head;
+	int done = 0;
+	while (done + 1 < b->seg_count &&
+			b->seg[done]->first + b->seg[done]->count <= keep)
+		_mish_segment_free(b, b->seg[done++]);
+	if (done) {
+		b->seg_count -= done;
+		memmove(b->seg, b->seg + done, b->seg_count * sizeof(b->seg[0]));
+	}
+	// the index could have been made smaller, or turned off
+	if (b->index.size > b->index.max)
+		_mish_backlog_index_trim(b, b->index.max);
+	if (b->seg_count < 2)
+		return;
+	/*
+	 * Compress (at most) one segment that went cold, so this never takes
+	 * very long.
+	 */
+	if (b->cold.next < b->head)
+		b->cold.next = b->head;
+	if ((b->cold.lines || b->cold.age) &&
+			b->cold.next < b->seg[b->seg_count - 1]->first) {
+		mish_segment_p s = b->seg[_mish_backlog_find(b, b->cold.next)];
+		uint64_t end = s->first + s->count;
+		int cold = (b->cold.lines && b->tail - end >= b->cold.lines) ||
+				(b->cold.age &&
+					_mish_stamp_ms() - s->stamp >= b->cold.age * 1000ULL);
+		if (cold && (!pin || end <= pin)) {
+			if (!s->cold)
+				_mish_segment_compress(b, s);
+			b->cold.next = end;
+		}
+	}
+	/* drop the decompressed segments nobody looked at for the longest */
+	while (b->cold.loaded > MISH_BACKLOG_LOADED) {
+		mish_segment_p lru = NULL;
+		for (int i = 0; i < b->seg_count; i++) {
+			mish_segment_p s = b->seg[i];
+			if (s->data && s->packed &&
+					(!pin || s->first + s->count <= pin) &&
+					(!lru || s->touched < lru->touched))
+				lru = s;
+		}
+		if (!lru)
+			break;
+		_mish_backlog_data_free(b, lru->data);
+		lru->data = NULL;
+		b->cold.loaded--;
+	}
+}
+
+size_t
+_mish_backlog_parse_size(
+		const char * s)
+{
+	char * e = NULL;
+	size_t res = strtoull(s, &e, 0);
+	switch (e ? toupper(*e) : 0) {
+		case 'G': res *= 1024;	// fallthrough
+		case 'M': res *= 1024;	// fallthrough
+		case 'K': res *= 1024;
+	}
+	return res;
+}
@@ -0,0 +1,257 @@
+/*
+ * mish_backlog_search.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "mish_priv.h"
+#include "mish_priv_backlog.h"
+
+static uint64_t
+_mish_search_now_us()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec * 1000000ULL) + (t.tv_nsec / 1000);
+}
+
+static void
+_mish_search_add(
+		mish_search_seg_t * g,
+		uint64_t seq)
+{
+	if (g->hit_count == g->hit_size) {
+		g->hit_size = g->hit_size ? g->hit_size * 2 : 64;
+		g->hit = realloc(g->hit, g->hit_size * sizeof(g->hit[0]));
+	}
+	g->hit[g->hit_count++] = seq;
+}
+
+/*
+ * The text of a segment is all its lines, one after the other, so it's
+ * scanned in one go; when there's a match, we find which line it is in,
+ * and carry on from the next line.
+ */
+static void
+_mish_search_segment(
+		mish_search_p s,
+		mish_search_seg_t * g,
+		mish_segment_data_p d)
+{
+	const uint8_t * text = (const uint8_t *)d->text;
+	const uint8_t * p = text, * e = text + g->used;
+	const uint8_t * n = (const uint8_t *)s->pattern;
+	uint32_t line = 0;
+
+	while ((p = _mish_scan_find(p, e, n, s->len)) != NULL) {
+		uint32_t o = p - text;
+		// last line that starts at, or before the match
+		uint32_t lo = line, hi = g->count - 1;
+		while (lo < hi) {
+			uint32_t mid = (lo + hi + 1) / 2;
+			if (d->index[MISH_SEGMENT_INDEX_SIZE - 1 - mid].offset <= o)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		mish_backlog_line_p l = &d->index[MISH_SEGMENT_INDEX_SIZE - 1 - lo];
+		// straddles two lines, that's not a match
+		if (o + s->len > l->offset + l->len) {
+			p++;
+			line = lo;
+			continue;
+		}
+		if (g->first + lo >= s->pin)
+			_mish_search_add(g, g->first + lo);
+		p = text + l->offset + l->len;
+		line = lo + 1;
+		if (line >= g->count)
+			break;
+	}
+}
+
+/*
+ * Each worker takes the next segment nobody looked at yet, until there
+ * are none left; they are all about the same size, so that's fair enough.
+ */
+static void *
+_mish_search_worker(
+		void * param)
+{
+	mish_search_p s = param;
+	mish_segment_data_p cold = NULL;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED)) <
+				s->seg_count && !__atomic_load_n(&s->cancel, __ATOMIC_RELAXED)) {
+		mish_search_seg_t * g = &s->seg[i];
+		/*
+		 * The segments are taken in order, so once the ones before this one
+		 * have enough hits, the rest isn't needed; that keeps the hits we
+		 * hold to MAX_HITS, and a segment's worth per worker.
+		 */
+		if (__atomic_load_n(&s->total, __ATOMIC_RELAXED) >=
+					MISH_SEARCH_MAX_HITS) {
+			g->cut = 1;
+			continue;
+		}
+		mish_segment_data_p d = g->data;
+		// cold segments are decompressed here, the capture thread's cache
+		// of loaded segments is not ours to use
+		if (!d) {
+			size_t index = g->count * sizeof(mish_backlog_line_t);
+			if (!cold)
+				cold = malloc(sizeof(*cold));
+			if (_mish_lz_decompress(g->packed, g->packed_text,
+						cold->text, g->used) != g->used ||
+					_mish_lz_decompress(g->packed + g->packed_text,
+						g->packed_size - g->packed_text,
+						&cold->index[MISH_SEGMENT_INDEX_SIZE - g->count],
+						index) != index)
+				continue;
+			d = cold;
+		}
+		_mish_search_segment(s, g, d);
+		__atomic_fetch_add(&s->total, g->hit_count, __ATOMIC_RELAXED);
+	}
+	free(cold);
+	return NULL;
+}
+
+/*
+ * This one starts the other workers, does its share, and once they are
+ * all done, puts the hits together; the segments are in line order, so
+ * that's all they need.
+ */
+static void *
+_mish_search_thread(
+		void * param)
+{
+	mish_search_p s = param;
+	uint64_t start = _mish_search_now_us();
+	unsigned int count = s->threads < s->seg_count ? s->threads : s->seg_count;
+	pthread_t worker[count ? count : 1];
+	unsigned int started = 0;
+
+	for (unsigned int i = 1; i < count; i++)
+		if (!pthread_create(&worker[started], NULL, _mish_search_worker, s))
+			started++;
+	_mish_search_worker(s);
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(worker[i], NULL);
+
+	for (unsigned int i = 0; i < s->seg_count; i++) {
+		s->count += s->seg[i].hit_count;
+		s->truncated |= s->seg[i].cut;
+	}
+	if (s->count > MISH_SEARCH_MAX_HITS) {
+		s->count = MISH_SEARCH_MAX_HITS;
+		s->truncated = 1;
+	}
+	s->hit = malloc((s->count ? s->count : 1) * sizeof(s->hit[0]));
+	for (unsigned int i = 0, o = 0; i < s->seg_count; i++) {
+		mish_search_seg_t * g = &s->seg[i];
+		unsigned int c = o + g->hit_count > s->count ?
+							s->count - o : g->hit_count;
+		memcpy(s->hit + o, g->hit, c * sizeof(s->hit[0]));
+		o += c;
+		free(g->hit);
+		g->hit = NULL;
+	}
+	s->took_us = _mish_search_now_us() - start;
+	__atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+	if (s->wake != -1 && write(s->wake, "s", 1))
+		;
+	return NULL;
+}
+
+mish_search_p
+_mish_backlog_search(
+		mish_backlog_p b,
+		const char * pattern,
+		int wake)
+{
+	mish_search_p s = calloc(1, sizeof(*s));
+
+	s->pattern = strdup(pattern);
+	s->len = strlen(pattern);
+	s->pin = b->head;
+	s->wake = wake;
+	s->threads = b->threads;
+	if (!s->threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		s->threads = cpus > 0 ? cpus : 1;
+	}
+	/* Take a copy of what the segments are now, the capture thread will
+	 * carry on adding lines, but these won't change */
+	s->seg = calloc(b->seg_count + 1, sizeof(s->seg[0]));
+	for (int i = 0; i < b->seg_count && s->len; i++) {
+		mish_segment_p g = b->seg[i];
+		if (g->first + g->count <= b->head)
+			continue;
+		// the index can tell us it's not worth looking
+		if (!_mish_backlog_index_match(g, pattern, s->len)) {
+			s->skipped++;
+			continue;
+		}
+		s->seg[s->seg_count++] = (mish_search_seg_t) {
+			.first = g->first, .count = g->count, .used = g->used,
+			.data = g->data, .packed = g->packed,
+			.packed_size = g->packed_size, .packed_text = g->packed_text,
+		};
+		// its lines can be replaced while we look, see _mish_backlog_replace()
+		if (i == b->seg_count - 1 && g->data) {
+			size_t index = g->count * sizeof(mish_backlog_line_t);
+			s->live = malloc(sizeof(*s->live));
+			memcpy(s->live->text, g->data->text, g->used);
+			memcpy(&s->live->index[MISH_SEGMENT_INDEX_SIZE - g->count],
+					&g->data->index[MISH_SEGMENT_INDEX_SIZE - g->count], index);
+			s->seg[s->seg_count - 1].data = s->live;
+		}
+	}
+	if (pthread_create(&s->thread, NULL, _mish_search_thread, s)) {
+		perror("mish: search thread");
+		s->seg_count = 0;
+		_mish_search_thread(s);
+		s->thread = 0;
+	}
+	return s;
+}
+
+void
+_mish_backlog_search_free(
+		mish_search_p s)
+{
+	if (!s)
+		return;
+	__atomic_store_n(&s->cancel, 1, __ATOMIC_RELAXED);
+	if (s->thread)
+		pthread_join(s->thread, NULL);
+	for (unsigned int i = 0; i < s->seg_count; i++)
+		free(s->seg[i].hit);
+	free(s->seg);
+	free(s->live);
+	free(s->hit);
+	free(s->pattern);
+	free(s);
+}
+
+const char *
+_mish_backlog_search_match(
+		mish_search_p s,
+		const char * text,
+		size_t len)
+{
+	if (!s->len)
+		return NULL;
+	return (const char *)_mish_scan_find((const uint8_t *)text,
+				(const uint8_t *)text + len,
+				(const uint8_t *)s->pattern, s->len);
+}
@@ -0,0 +1,164 @@
+/*
+ * mish_capture.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mish_priv.h"
+#include "mish.h"
+
+/*
+ * List of engines we can use, in order of preference. Since select()
+ * always works, anything after it has to be asked for explicitly.
+ */
+static const mish_capture_engine_t * _engines[] = {
+#ifdef __linux__
+	&_mish_capture_epoll,
+#endif
+	&_mish_capture_select,
+#ifdef MISH_HAS_IO_URING
+	&_mish_capture_uring,
+#endif
+	NULL,
+};
+
+int
+_mish_capture_init(
+		mish_p m)
+{
+	const char * want = getenv("MISH_CAPTURE");
+
+	if (want) {
+		for (int i = 0; _engines[i]; i++) {
+			if (strcmp(want, _engines[i]->name))
+				continue;
+			if (_engines[i]->init(m) == 0) {
+				m->engine = _engines[i];
+				return 0;
+			}
+		}
+		fprintf(stderr, "mish: capture engine '%s' not available\n", want);
+	}
+	for (int i = 0; _engines[i]; i++) {
+		if (_engines[i]->init(m) == 0) {
+			m->engine = _engines[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * We now use a thread to run the commands; this solve the problem of
+ * command generating a lot of output, deadlocking the capture thread,
+ * as the command write() would fill up the pipe buffer and block.
+ */
+void *
+_mish_cmd_runner_thread(
+		void *param)
+{
+	mish_p m = param;
+
+	printf("%s\n", __func__);
+	while (!(m->flags & MISH_QUIT)) {
+		_mish_cmd_wait(0);
+		_mish_cmd_flush(0);
+	};
+	printf("Exiting %s\n", __func__);
+	m->cmd_runner = 0;
+	return NULL;
+}
+
+/*
+ * This is the capture thread; the waiting for file descriptors is done by
+ * the capture engine, the rest (moving lines to the backlog, trimming it,
+ * removing dead clients) is common to all of them.
+ */
+void *
+_mish_capture_thread(
+		void *param)
+{
+	mish_p m = param;
+
+	while (!(m->flags & MISH_QUIT)) {
+		mish_client_p c;
+		int timeout = 1000;
+		// the partial lines that waited long enough are shown
+		uint64_t now = _mish_stamp_ms();
+		for (int i = 0; i < 2; i++) {
+			int due = _mish_input_flush(m, &m->origin[i], now);
+			if (due >= 0 && due < timeout)
+				timeout = due;
+		}
+		/*
+		 * Call each client state machine, handle new output,
+		 * new input, draw prompts etc etc.
+		 * Also allow clients to tweak their 'output request' flag here
+		 */
+		TAILQ_FOREACH(c, &m->clients, self)
+			c->cr.process(m, c);
+		_mish_metric_tick(m);
+
+		/*
+		 * This reads any input that is ready, accept new telnet
+		 * connections etc.
+		 */
+		if (m->engine->poll(m, timeout) <= 0)
+			continue;
+		mish_client_p safe;
+		// check if any client was closed down
+		TAILQ_FOREACH_SAFE(c, &m->clients, self, safe) {
+			if (c->input.fd == -1 || (c->flags & MISH_CLIENT_DELETE))
+				mish_client_delete(m, c);
+		}
+
+		unsigned int max_lines = m->backlog.max_lines;
+		if (m->flags & MISH_CLEAR_BACKLOG) {
+			max_lines = 1;	// zero is unlimited, we don't want that
+			m->flags &= ~MISH_CLEAR_BACKLOG;
+			printf("Clearing backlog has %d lines\n", m->backlog.size);
+		}
+		/*
+		 * Clients could still be writing lines from the backlog, so find
+		 * the oldest one, its segment can't be freed just yet.
+		 */
+		uint64_t pin = 0;
+		TAILQ_FOREACH(c, &m->closing, self)
+			if (c->output.pin && (!pin || c->output.pin < pin))
+				pin = c->output.pin;
+		TAILQ_FOREACH(c, &m->clients, self) {
+			if (c->output.pin && (!pin || c->output.pin < pin))
+				pin = c->output.pin;
+			// same for a search that is still looking at the lines
+			if ((c->flags & MISH_CLIENT_SEARCHING) &&
+					(!pin || c->search->pin < pin))
+				pin = c->search->pin;
+		}
+		/*
+		 * Clients that were displaying lines we remove here 'scroll' to the
+		 * first line we still have by themselves, see _mish_backlog_clamp()
+		 */
+		_mish_backlog_trim(&m->backlog, max_lines, pin);
+	}
+
+	if ((m->flags & MISH_CONSOLE_TTY) &&
+			tcsetattr(0, TCSAFLUSH, &m->orig_termios))
+		perror("thread tcsetattr");
+	/*
+	 * Try to be nice and tell all clients to cleanup
+	 */
+	mish_client_p c;
+	while ((c = TAILQ_FIRST(&m->clients)) != NULL)
+		mish_client_delete(m, c);
+//	m->flags &= ~MISH_QUIT;
+	m->capture = 0;	// mark the thread done
+//	printf("Exiting %s\n", __func__);
+	exit(0);	// this calls mish_terminate, on main thread
+//	return NULL;
+}
@@ -0,0 +1,152 @@
+/*
+ * mish_capture_epoll.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include "mish_priv.h"
+#include "mish.h"
+
+/*
+ * epoll() based capture engine. Unlike select(), there is no limit on the
+ * descriptor numbers, and each wakeup only costs us the descriptors that
+ * are actually ready, as the epoll_event tells us directly which input
+ * it belongs to.
+ */
+#define MISH_EPOLL_EVENTS	32
+
+static int
+_mish_epoll_init(
+		mish_p m)
+{
+	m->epoll.fd = epoll_create1(EPOLL_CLOEXEC);
+	if (m->epoll.fd == -1) {
+		perror("mish: epoll_create1");
+		return -1;
+	}
+	m->epoll.unpollable = 0;
+	return 0;
+}
+
+static void
+_mish_epoll_dispose(
+		mish_p m)
+{
+	if (m->epoll.fd != -1)
+		close(m->epoll.fd);
+	m->epoll.fd = -1;
+}
+
+/*
+ * Regular files (and /dev/null) can't be added to an epoll set, but
+ * select() considers them always ready, so we keep a small list of them
+ * to do the same.
+ */
+static void
+_mish_epoll_unpollable(
+		mish_p m,
+		int fd,
+		unsigned int events,
+		void * refcon)
+{
+	for (int i = 0; i < m->epoll.unpollable; i++) {
+		if (m->epoll.up[i].fd != fd)
+			continue;
+		if (events) {
+			m->epoll.up[i].events = events;
+			m->epoll.up[i].refcon = refcon;
+		} else
+			m->epoll.up[i] = m->epoll.up[--m->epoll.unpollable];
+		return;
+	}
+	if (!events)
+		return;
+	if (m->epoll.unpollable == sizeof(m->epoll.up) / sizeof(m->epoll.up[0])) {
+		fprintf(stderr, "mish: %s too many descriptors\n", __func__);
+		return;
+	}
+	m->epoll.up[m->epoll.unpollable].fd = fd;
+	m->epoll.up[m->epoll.unpollable].events = events;
+	m->epoll.up[m->epoll.unpollable].refcon = refcon;
+	m->epoll.unpollable++;
+}
+
+static void
+_mish_epoll_watch(
+		mish_p m,
+		int fd,
+		unsigned int events,
+		void * refcon)
+{
+	struct epoll_event e = {
+		.events = ((events & MISH_WATCH_READ) ? EPOLLIN : 0) |
+					((events & MISH_WATCH_WRITE) ? EPOLLOUT : 0),
+		.data.ptr = refcon,
+	};
+	if (!events) {
+		/* we can't rely on close() for this, the telnet in/out are dup()s */
+		if (epoll_ctl(m->epoll.fd, EPOLL_CTL_DEL, fd, NULL) == -1)
+			_mish_epoll_unpollable(m, fd, 0, NULL);
+		return;
+	}
+	if (epoll_ctl(m->epoll.fd, EPOLL_CTL_MOD, fd, &e) == 0)
+		return;
+	if (errno == ENOENT &&
+			epoll_ctl(m->epoll.fd, EPOLL_CTL_ADD, fd, &e) == 0)
+		return;
+	if (errno == EPERM)
+		_mish_epoll_unpollable(m, fd, events, refcon);
+	else
+		perror("mish: epoll_ctl");
+}
+
+static void
+_mish_epoll_ready(
+		mish_p m,
+		void * refcon)
+{
+	if (!refcon)	// client output, this was just a wake up call
+		return;
+	if (refcon == &m->telnet)
+		mish_telnet_in_check(m);
+	else
+		_mish_input_read(m, refcon);
+}
+
+static int
+_mish_epoll_poll(
+		mish_p m,
+		int timeout_ms)
+{
+	struct epoll_event ev[MISH_EPOLL_EVENTS];
+
+	if (m->epoll.unpollable)
+		timeout_ms = 0;
+	int cnt = epoll_wait(m->epoll.fd, ev, MISH_EPOLL_EVENTS, timeout_ms);
+	if (cnt < 0)	// EINTR etc
+		return cnt;
+	for (int i = 0; i < cnt; i++)
+		_mish_epoll_ready(m, ev[i].data.ptr);
+	/* these might remove themselves from the list on EOF, walk backward */
+	for (int i = m->epoll.unpollable - 1; i >= 0; i--, cnt++)
+		_mish_epoll_ready(m, m->epoll.up[i].refcon);
+	return cnt;
+}
+
+const mish_capture_engine_t _mish_capture_epoll = {
+	.name = "epoll",
+	.init = _mish_epoll_init,
+	.dispose = _mish_epoll_dispose,
+	.watch = _mish_epoll_watch,
+	.poll = _mish_epoll_poll,
+};
+
+#endif /* __linux__ */
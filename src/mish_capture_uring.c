@@ -0,0 +1,522 @@
+/*
+ * mish_capture_uring.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include "mish_priv.h"
+
+#ifdef MISH_HAS_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "mish.h"
+
+/*
+ * io_uring based capture engine. We don't use liburing, there is only a
+ * handful of operations we need, so we talk to the kernel directly.
+ *
+ * Inputs get a multishot read posted once, and it keeps posting completions
+ * as data arrives, using buffers from a 'provided buffer ring' that we
+ * recycle as soon as the data has been copied into the input line. If the
+ * kernel is too old for multishot reads (6.7), we fall back to posting
+ * poll requests and read()ing as usual.
+ *
+ * Client output is submitted as a POLLOUT poll linked to the writev()(s),
+ * so the whole output of a loop iteration, the input re-arms and the wait
+ * for new events all cost a single io_uring_enter().
+ */
+#define MISH_URING_ENTRIES		256
+#define MISH_URING_BUFS			64		// power of two
+#define MISH_URING_BUF_SIZE		4096
+#define MISH_URING_BGID			0
+#ifndef IOV_MAX
+#define IOV_MAX					1024
+#endif
+/* Not in older kernel headers; IORING_OP_READ_MULTISHOT, kernel 6.7 */
+#define MISH_URING_OP_READ_MULTISHOT	49
+
+/* user_data is an index in the op table, plus one of these in the top bits */
+#define MISH_URING_UD_MAIN		0ULL
+#define MISH_URING_UD_POLLHEAD	1ULL	// the poll in front of a writev chain
+#define MISH_URING_UD_CANCEL	2ULL
+#define MISH_URING_UD(_idx, _sub) ((uint64_t)(_idx) | ((_sub) << 32))
+
+enum {
+	MISH_URING_FREE = 0,
+	MISH_URING_READ,		// multishot read, refcon is the mish_input_p
+	MISH_URING_POLL,		// one shot poll, input or telnet listen socket
+	MISH_URING_WRITE,		// writev chain, refcon is the mish_client_p
+};
+
+typedef struct mish_uring_op_t {
+	int				fd;
+	uint8_t			kind;
+	uint8_t			dead : 1,	// watch() told us to forget about it
+					failed : 1;	// a write failed
+	uint16_t		inflight;	// SQEs posted, but not completed yet
+	void *			refcon;
+	ssize_t			written;	// for writes, bytes written so far
+} mish_uring_op_t;
+
+typedef struct mish_uring_t {
+	int				fd;
+	unsigned int	features;
+	/* submission ring */
+	unsigned int	*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int	sq_entries;
+	unsigned int	tail;		// our local copy of the SQ tail
+	struct io_uring_sqe * sqes;
+	/* completion ring */
+	unsigned int	*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe * cqes;
+	/* mmap()ed areas */
+	void *			sq_ptr, * cq_ptr;
+	size_t			sq_size, cq_size, sqes_size;
+	/* provided buffers for the multishot reads, NULL if not supported */
+	struct io_uring_buf_ring * br;
+	uint16_t		br_tail;
+	uint8_t *		bufs;
+	/* our operations, the index is used as user_data */
+	mish_uring_op_t * op;
+	int				op_size;
+} mish_uring_t, *mish_uring_p;
+
+static int
+_mish_uring_enter(
+		mish_uring_p u,
+		unsigned int min_complete,
+		int timeout_ms)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000,
+	};
+	struct io_uring_getevents_arg arg = {
+		.ts = (uintptr_t)&ts,
+	};
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+	unsigned int submit = u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	return syscall(__NR_io_uring_enter, u->fd, submit, min_complete,
+			IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			&arg, sizeof(arg));
+}
+
+static struct io_uring_sqe *
+_mish_uring_sqe(
+		mish_uring_p u,
+		uint64_t user_data)
+{
+	/* if the ring is full, submit what we have, without waiting */
+	if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+			u->sq_entries)
+		_mish_uring_enter(u, 0, 0);
+	unsigned int idx = u->tail & *u->sq_mask;
+	struct io_uring_sqe * sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = user_data;
+	u->sq_array[idx] = idx;
+	u->tail++;
+	return sqe;
+}
+
+static void
+_mish_uring_buf_add(
+		mish_uring_p u,
+		uint16_t bid)
+{
+	/* can't assign the whole struct, the tail overlays bufs[0].resv */
+	struct io_uring_buf * b = &u->br->bufs[u->br_tail & (MISH_URING_BUFS - 1)];
+	b->addr = (uintptr_t)(u->bufs + (bid * MISH_URING_BUF_SIZE));
+	b->len = MISH_URING_BUF_SIZE;
+	b->bid = bid;
+	u->br_tail++;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Find the op for 'fd', or a free one if 'alloc' is set
+ */
+static int
+_mish_uring_op(
+		mish_uring_p u,
+		int fd,
+		int write,
+		int alloc)
+{
+	int free_idx = -1;
+	for (int i = 0; i < u->op_size; i++) {
+		mish_uring_op_t * op = &u->op[i];
+		if (op->kind == MISH_URING_FREE) {
+			if (free_idx == -1)
+				free_idx = i;
+			continue;
+		}
+		if (op->fd == fd && !op->dead &&
+				(op->kind == MISH_URING_WRITE) == !!write)
+			return i;
+	}
+	if (!alloc)
+		return -1;
+	if (free_idx == -1) {
+		free_idx = u->op_size;
+		u->op_size += 8;
+		u->op = realloc(u->op, u->op_size * sizeof(u->op[0]));
+		memset(u->op + free_idx, 0, 8 * sizeof(u->op[0]));
+	}
+	memset(&u->op[free_idx], 0, sizeof(u->op[0]));
+	u->op[free_idx].fd = fd;
+	return free_idx;
+}
+
+static void
+_mish_uring_arm(
+		mish_uring_p u,
+		int idx)
+{
+	mish_uring_op_t * op = &u->op[idx];
+	struct io_uring_sqe * sqe = _mish_uring_sqe(u,
+									MISH_URING_UD(idx, MISH_URING_UD_MAIN));
+	sqe->fd = op->fd;
+	if (op->kind == MISH_URING_READ) {
+		sqe->opcode = MISH_URING_OP_READ_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = MISH_URING_BGID;
+	} else {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLIN;
+	}
+	op->inflight++;
+}
+
+/*
+ * Cancel anything that is still pending for this op. The cancel requests
+ * themselves count as 'inflight', so the slot can't be reused until they
+ * are done too.
+ */
+static void
+_mish_uring_cancel(
+		mish_uring_p u,
+		int idx)
+{
+	mish_uring_op_t * op = &u->op[idx];
+	op->dead = 1;
+	if (!op->inflight) {
+		op->kind = MISH_URING_FREE;
+		return;
+	}
+	for (int i = 0; i < 1 + (op->kind == MISH_URING_WRITE); i++) {
+		struct io_uring_sqe * sqe = _mish_uring_sqe(u,
+									MISH_URING_UD(idx, MISH_URING_UD_CANCEL));
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = MISH_URING_UD(idx,
+						i ? MISH_URING_UD_POLLHEAD : MISH_URING_UD_MAIN);
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+		op->inflight++;
+	}
+}
+
+static int
+_mish_uring_init(
+		mish_p m)
+{
+	mish_uring_p u = calloc(1, sizeof(*u));
+	struct io_uring_params p = {};
+
+	u->fd = syscall(__NR_io_uring_setup, MISH_URING_ENTRIES, &p);
+	if (u->fd < 0) {
+		perror("mish: io_uring_setup");
+		free(u);
+		return -1;
+	}
+	u->features = p.features;
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {	// kernel is too old
+		errno = ENOSYS;
+		goto error;
+	}
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_size > u->sq_size)
+			u->sq_size = u->cq_size;
+		u->cq_size = 0;
+	}
+	u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED)
+		goto error;
+	u->cq_ptr = u->sq_ptr;
+	if (u->cq_size) {
+		u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED)
+			goto error;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto error;
+	u->sq_head = u->sq_ptr + p.sq_off.head;
+	u->sq_tail = u->sq_ptr + p.sq_off.tail;
+	u->sq_mask = u->sq_ptr + p.sq_off.ring_mask;
+	u->sq_array = u->sq_ptr + p.sq_off.array;
+	u->sq_entries = p.sq_entries;
+	u->tail = *u->sq_tail;
+	u->cq_head = u->cq_ptr + p.cq_off.head;
+	u->cq_tail = u->cq_ptr + p.cq_off.tail;
+	u->cq_mask = u->cq_ptr + p.cq_off.ring_mask;
+	u->cqes = u->cq_ptr + p.cq_off.cqes;
+
+	/*
+	 * Check for multishot read support, and if so, register the
+	 * buffer ring they will use.
+	 */
+	struct {
+		struct io_uring_probe	p;
+		struct io_uring_probe_op ops[256];
+	} probe = {};
+	if (syscall(__NR_io_uring_register, u->fd,
+				IORING_REGISTER_PROBE, &probe, 256) == 0 &&
+			probe.p.ops_len > MISH_URING_OP_READ_MULTISHOT &&
+			(probe.p.ops[MISH_URING_OP_READ_MULTISHOT].flags &
+					IO_URING_OP_SUPPORTED)) {
+		size_t rs = MISH_URING_BUFS * sizeof(struct io_uring_buf);
+		u->br = mmap(NULL, rs, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		struct io_uring_buf_reg reg = {
+			.ring_addr = (uintptr_t)u->br,
+			.ring_entries = MISH_URING_BUFS,
+			.bgid = MISH_URING_BGID,
+		};
+		if (u->br == MAP_FAILED ||
+				syscall(__NR_io_uring_register, u->fd,
+					IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+			if (u->br != MAP_FAILED)
+				munmap(u->br, rs);
+			u->br = NULL;
+		} else {
+			u->bufs = malloc(MISH_URING_BUFS * MISH_URING_BUF_SIZE);
+			for (int i = 0; i < MISH_URING_BUFS; i++)
+				_mish_uring_buf_add(u, i);
+		}
+	}
+	m->uring = u;
+	return 0;
+error:
+	perror("mish: io_uring");
+	if (u->sqes && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_size && u->cq_ptr && u->cq_ptr != MAP_FAILED)
+		munmap(u->cq_ptr, u->cq_size);
+	if (u->sq_ptr && u->sq_ptr != MAP_FAILED)
+		munmap(u->sq_ptr, u->sq_size);
+	close(u->fd);
+	free(u);
+	return -1;
+}
+
+static void
+_mish_uring_dispose(
+		mish_p m)
+{
+	mish_uring_p u = m->uring;
+	if (!u)
+		return;
+	close(u->fd);
+	munmap(u->sqes, u->sqes_size);
+	if (u->cq_size)
+		munmap(u->cq_ptr, u->cq_size);
+	munmap(u->sq_ptr, u->sq_size);
+	if (u->br) {
+		munmap(u->br, MISH_URING_BUFS * sizeof(struct io_uring_buf));
+		free(u->bufs);
+	}
+	free(u->op);
+	free(u);
+	m->uring = NULL;
+}
+
+static void
+_mish_uring_watch(
+		mish_p m,
+		int fd,
+		unsigned int events,
+		void * refcon)
+{
+	mish_uring_p u = m->uring;
+
+	if (!events) {	// forget about any op on this descriptor
+		for (int w = 0; w < 2; w++) {
+			int idx = _mish_uring_op(u, fd, w, 0);
+			if (idx != -1)
+				_mish_uring_cancel(u, idx);
+		}
+		return;
+	}
+	/* we do the writes ourselves, no need to 'wait' for permission */
+	if (!(events & MISH_WATCH_READ))
+		return;
+	int idx = _mish_uring_op(u, fd, 0, 1);
+	mish_uring_op_t * op = &u->op[idx];
+	op->refcon = refcon;
+	if (op->kind != MISH_URING_FREE)
+		return;	// already armed
+	op->kind = u->br && refcon != &m->telnet ?
+					MISH_URING_READ : MISH_URING_POLL;
+	_mish_uring_arm(u, idx);
+}
+
+static int
+_mish_uring_writev(
+		mish_p m,
+		mish_client_p c,
+		const struct iovec * io,
+		int ioc)
+{
+	mish_uring_p u = m->uring;
+	int idx = _mish_uring_op(u, c->output.fd, 1, 1);
+	mish_uring_op_t * op = &u->op[idx];
+
+	op->kind = MISH_URING_WRITE;
+	op->refcon = c;
+	op->written = 0;
+	op->failed = 0;
+	/* the descriptor is non blocking, so wait for it to be writable first */
+	struct io_uring_sqe * sqe = _mish_uring_sqe(u,
+								MISH_URING_UD(idx, MISH_URING_UD_POLLHEAD));
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = op->fd;
+	sqe->poll32_events = POLLOUT;
+	sqe->flags = IOSQE_IO_LINK;
+	op->inflight++;
+	/* a short write breaks the chain, the rest will be resubmitted */
+	while (ioc) {
+		int cnt = ioc > IOV_MAX ? IOV_MAX : ioc;
+		sqe = _mish_uring_sqe(u, MISH_URING_UD(idx, MISH_URING_UD_MAIN));
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = op->fd;
+		sqe->addr = (uintptr_t)io;
+		sqe->len = cnt;
+		sqe->off = (uint64_t)-1;	// current file position, if any
+		io += cnt;
+		ioc -= cnt;
+		if (ioc)
+			sqe->flags = IOSQE_IO_LINK;
+		op->inflight++;
+	}
+	return 0;
+}
+
+static void
+_mish_uring_complete(
+		mish_p m,
+		struct io_uring_cqe * cqe)
+{
+	mish_uring_p u = m->uring;
+	int idx = cqe->user_data & 0xffffffff;
+	uint64_t sub = cqe->user_data >> 32;
+	// the callbacks can add ops, and the table can move; see _mish_uring_op()
+	mish_uring_op_t * op = &u->op[idx];
+	int more = cqe->flags & IORING_CQE_F_MORE;
+
+	if (!more)
+		op->inflight--;
+	switch (sub == MISH_URING_UD_CANCEL ? MISH_URING_FREE : op->kind) {
+		case MISH_URING_READ: {
+			uint8_t * buf = NULL;
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+				buf = u->bufs + ((cqe->flags >> IORING_CQE_BUFFER_SHIFT) *
+									MISH_URING_BUF_SIZE);
+			if (!op->dead) {
+				if (cqe->res >= 0)
+					_mish_input_append(m, op->refcon, buf, cqe->res);
+				else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+					/* not a pollable file, do it the old way */
+					_mish_input_read(m, op->refcon);
+					op = &u->op[idx];
+					op->kind = MISH_URING_POLL;
+				}
+				op = &u->op[idx];
+			}
+			if (buf)
+				_mish_uring_buf_add(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			if (!more && !op->dead)
+				_mish_uring_arm(u, idx);
+		}	break;
+		case MISH_URING_POLL:
+			if (op->dead || cqe->res == -ECANCELED)
+				break;
+			if (op->refcon == &m->telnet)
+				mish_telnet_in_check(m);
+			else
+				_mish_input_read(m, op->refcon);
+			op = &u->op[idx];
+			if (!op->dead)
+				_mish_uring_arm(u, idx);
+			break;
+		case MISH_URING_WRITE:
+			if (sub == MISH_URING_UD_POLLHEAD) {
+				if (cqe->res < 0 && cqe->res != -ECANCELED)
+					op->failed = 1;
+			} else if (cqe->res > 0)
+				op->written += cqe->res;
+			else if (cqe->res < 0 && cqe->res != -ECANCELED &&
+					cqe->res != -EAGAIN)
+				op->failed = 1;
+			if (!op->inflight && !op->dead)
+				_mish_send_written(op->refcon,
+						op->written ? op->written : op->failed ? -1 : 0);
+			break;
+	}
+	if (op->dead && !op->inflight) {
+		// the client was deleted while we wrote for it, it can go now
+		if (op->kind == MISH_URING_WRITE && op->refcon)
+			_mish_send_written(op->refcon, -1);
+		op->kind = MISH_URING_FREE;
+	}
+}
+
+static int
+_mish_uring_poll(
+		mish_p m,
+		int timeout_ms)
+{
+	mish_uring_p u = m->uring;
+	/* don't wait if there are completions already waiting for us */
+	unsigned int head = *u->cq_head;
+	int wait = head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+	int res = _mish_uring_enter(u, wait, timeout_ms);
+	if (res < 0 && errno != ETIME && errno != EINTR)
+		perror("mish: io_uring_enter");
+	int cnt = 0;
+	unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		_mish_uring_complete(m, &u->cqes[head & *u->cq_mask]);
+		head++;
+		cnt++;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return cnt;
+}
+
+const mish_capture_engine_t _mish_capture_uring = {
+	.name = "io_uring",
+	.init = _mish_uring_init,
+	.dispose = _mish_uring_dispose,
+	.watch = _mish_uring_watch,
+	.poll = _mish_uring_poll,
+	.writev = _mish_uring_writev,
+};
+
+#endif /* MISH_HAS_IO_URING */
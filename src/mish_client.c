@@ -11,6 +11,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #include "mish_priv.h"
 #include "mish.h"
 #include "minipt.h"
@@ -27,7 +28,7 @@ mish_client_new(
 
 	_mish_input_init(m, &c->input, in);
 	if (is_tty) {
-		c->input.process_char = _mish_client_vt_parse_input;
+		c->input.process = _mish_client_vt_parse_input;
 		c->cr.process = _mish_client_interractive_cr;
 	} else {
 		c->cr.process = _mish_client_dumb_cr;
@@ -43,8 +44,6 @@ mish_client_new(
 	int fds[2] = { in, out};
 	for (int i = 0; i < 2; i++) {
 		int fd = fds[i];
-		if (fd >= m->select.max - 1)
-			m->select.max = fd +1;
 		int flags = fcntl(fd, F_GETFL, NULL);
 		if (flags == 1) {
 			perror("mish: input F_GETFL");
@@ -71,8 +70,7 @@ mish_client_delete(
 	for (int i = 0; i < 2; i++) {
 		if (fds[i] == -1)
 			continue;
-		FD_CLR(fds[i], &m->select.read);
-		FD_CLR(fds[i], &m->select.write);
+		_mish_capture_watch(m, fds[i], 0, NULL);
 		int flags;
 		if (fcntl(fds[i], F_GETFL, &flags) == 0) {
 			flags &= ~O_NONBLOCK;
@@ -80,7 +78,7 @@ mish_client_delete(
 				/* don't care */;
 		}
 	}
-	const char * restore = "\033[4l\033[;r\033[999;1H";
+	const char * restore = "\033[?2004l\033[4l\033[;r\033[999;1H";
 	if (write(c->output.fd, restore, strlen(restore)))
 		;
 	close(c->output.fd);
@@ -88,7 +86,30 @@ mish_client_delete(
 	TAILQ_REMOVE(&m->clients, c, self);
 	if (c == m->console)
 		m->console = NULL;
+	_mish_backlog_search_free(c->search);
+	_mish_filter_release(m, c->filter);
 	_mish_input_clear(m, &c->input);
+	/*
+	 * The engine could still be writing our output (io_uring); the vectors
+	 * and what they point to have to stay until it tells us it's done.
+	 */
+	if (c->flags & MISH_CLIENT_WRITING) {
+		c->flags |= MISH_CLIENT_CLOSING;
+		TAILQ_INSERT_TAIL(&m->closing, c, self);
+		return;
+	}
+	_mish_client_free(c);
+}
+
+void
+_mish_client_free(
+		mish_client_p c)
+{
+	if (c->flags & MISH_CLIENT_CLOSING)
+		TAILQ_REMOVE(&c->mish->closing, c, self);
+	free(c->output.v);
+	free(c->output.sqb);
+	free(c->screen.row);
 	free(c);
 }
 
@@ -106,14 +127,56 @@ _mish_client_set_prompt(
 		strncpy(c->prompt, p, sizeof(c->prompt)-1);
 
 	mish_vt_sequence_t sq = {};
-	char *s = c->prompt;
-	c->prompt_gc = 0;
-	while (*s) {
-		if (_mish_vt_sequence_char(&sq, *s))
-			if (sq.glyph)
-				c->prompt_gc++;
-		s++;
+	c->prompt_gc = _mish_vt_glyph_count(&sq, c->prompt, strlen(c->prompt));
+}
+
+uint64_t
+_mish_client_walk_rows(
+		mish_p m,
+		mish_client_p c,
+		uint64_t seq,
+		int rows)
+{
+	int up = rows < 0;
+
+	seq = _mish_backlog_clamp(&m->backlog, seq);
+	for (rows = up ? -rows : rows; seq && rows > 0; ) {
+		rows -= _mish_client_line_rows(m, c, seq);
+		seq = up ? _mish_client_prev(m, c, seq) :
+				_mish_client_next(m, c, seq);
 	}
+	return seq;
+}
+
+/*
+ * A line changed in the backlog, it's a progress bar or the like; if it's
+ * on screen, the window is updated, that only sends the rows that changed.
+ */
+static void
+_mish_client_replaced(
+		mish_p m,
+		mish_client_p c)
+{
+	mish_backlog_p b = &m->backlog;
+	uint64_t seq = b->replaced.seq;
+	// other lines changed before that one, we don't know which
+	int missed = (int32_t)(b->replaced.since - c->replaced) > 1;
+
+	c->replaced = b->replaced.gen;
+	if (missed) {
+		_mish_screen_forget(c);
+		c->flags |= MISH_CLIENT_UPDATE_WINDOW;
+		return;
+	}
+	_mish_screen_changed(c, seq);
+	// it hasn't been sent yet, it will be as it is now
+	if (c->sending && seq >= c->sending)
+		return;
+	uint64_t bottom = c->bottom ? c->bottom : _mish_client_last(m, c);
+	uint64_t top = _mish_client_walk_rows(m, c, bottom,
+						-(c->window_size.h - c->footer_height));
+	if (seq <= bottom && (!top || seq >= top))
+		c->flags |= MISH_CLIENT_UPDATE_WINDOW;
 }
 
 /*
@@ -159,39 +222,16 @@ _mish_client_interractive_cr(
 	}
 	/* We are live scrolling, and we are at the last line of scrollback */
 	c->flags |= MISH_CLIENT_INIT_SENT | MISH_CLIENT_SCROLLING;
-	c->bottom = TAILQ_LAST(&m->backlog.log, mish_line_queue_t);
+	c->bottom = _mish_client_last(m, c);
+	/* ask for bracketed paste, so big pastes are just text */
+	_mish_send_queue(c, "\033[?2004h");
 	/*
-	 * This is where we arrive to draw the entire screen; to start up,
-	 * and each time you do a control-l (TODO: or if the window is resized)
-	 * Or use the scrollback (page Up/down etc)
+	 * This is where we arrive to draw the window; to start up, each time
+	 * you do a control-l, the window is resized, or you use the scrollback
+	 * (page Up/down etc). Only the rows that changed are sent.
 	 */
 redraw:
-	c->flags |= MISH_CLIENT_UPDATE_PROMPT;
-	c->sending = c->bottom;
-	c->current_vpos = c->window_size.h - c->footer_height;
-	/*
-	 * walk back from the 'bottom' line we want until we reach the top of the
-	 * screen, or ran out of lines.
-	 */
-	while (c->sending && c->current_vpos >= 1) {
-		mish_line_p p = TAILQ_PREV(c->sending, mish_line_queue_t, self);
-		if (p) {
-			c->sending = p;
-			c->current_vpos--;
-		} else
-			break;
-	}
-	/*
-	 * Now, we've just connected here, and there might be backlog, and we want
-	 * just enough of that to fill our screen
-	 */
-	/* Set the scrolling region to all minus the 2 bottom lines */
-	_mish_send_queue_fmt(c, "\033D\033[1;%dr",
-			c->window_size.h - c->footer_height);
-	_mish_send_queue_fmt(c,
-			"\033[%d;1H"
-			"\033[J",	// clear to bottom of scrolling area
-			c->current_vpos);
+	_mish_screen_update(m, c);
 	do {
 		if (c->flags & MISH_CLIENT_UPDATE_WINDOW) {
 			c->flags &= ~MISH_CLIENT_UPDATE_WINDOW;
@@ -230,15 +270,26 @@ redraw:
 				pt_yield(c->cr.state);
 		} else
 			pt_yield(c->cr.state);
+		/* lines could have been trimmed while we were away */
+		c->bottom = _mish_backlog_clamp(&m->backlog, c->bottom);
+		c->sending = _mish_backlog_clamp(&m->backlog, c->sending);
+		if (c->replaced != m->backlog.replaced.gen)
+			_mish_client_replaced(m, c);
+		if ((c->flags & MISH_CLIENT_SEARCHING) &&
+				_mish_backlog_search_done(c->search))
+			_mish_client_search_done(m, c);
+		/* keys that arrived while we were sending, if any */
+		if (c->input.line && c->input.line->len)
+			_mish_client_vt_parse_input(m, &c->input);
 
 		if (!c->sending) {
 			/* we're starting up, pool the backlog for a line to display */
 			if (!c->bottom) {
-				c->bottom = TAILQ_LAST(&m->backlog.log, mish_line_queue_t);
+				c->bottom = _mish_client_last(m, c);
 				c->sending = c->bottom;
 			} else {
 				// we WERE at the bottom, so find a possible next line
-				mish_line_p next = TAILQ_NEXT(c->bottom, self);
+				uint64_t next = _mish_client_next(m, c, c->bottom);
 				if (c->flags & MISH_CLIENT_SCROLLING) {
 					if (next) {
 						c->bottom = c->sending = next;
@@ -265,21 +316,19 @@ redraw:
 		 */
 		size_t screen_worth = (c->window_size.h * c->window_size.w) / 1;
 		do {
-			if (c->sending->err)
-				_mish_send_queue(c, MISH_COLOR_RED);
-			_mish_send_queue_line(c, c->sending);
-			if (c->sending->err)
-				_mish_send_queue(c, "\033[m");
-			// if we reach the bottom mark, stop
-			c->sending = c->sending == c->bottom ?
-					NULL : TAILQ_NEXT(c->sending, self);
+			_mish_client_queue_line(m, c, c->sending);
+			// the cursor moved down as many rows, or the area scrolled
+			_mish_screen_sent(m, c, c->sending, c->current_vpos,
+					_mish_client_line_rows(m, c, c->sending));
+			c->current_vpos += _mish_client_line_rows(m, c, c->sending);
+			if (c->current_vpos > c->window_size.h - c->footer_height)
+				c->current_vpos = c->window_size.h - c->footer_height;
+			// if we reach the bottom mark, stop; it could be a line the
+			// filter hides, if it was trimmed from under us
+			c->sending = c->sending >= c->bottom ?
+					0 : _mish_client_next(m, c, c->sending);
 		} while (c->sending &&
 				(c->output.total - start) <= screen_worth);
-		// update cursor position here -- SHOULD update it with each lines,
-		// to handle word wrapping, but for now it's OK
-		// TODO: Update cursor V pos handling line wrap
-		if (!c->sending)
-			c->current_vpos = c->window_size.h - c->footer_height;
 		/* Restore the cursor to the prompt area */
 		_mish_send_queue(c, "\033[u");
 	} while(1);
@@ -300,18 +349,23 @@ _mish_client_dumb_cr(
 	printf(MISH_COLOR_RED "mish: Started dumb console\n" MISH_COLOR_RESET);
 	do {
 		pt_yield(c->cr.state);
+		c->bottom = _mish_backlog_clamp(&m->backlog, c->bottom);
+		c->sending = _mish_backlog_clamp(&m->backlog, c->sending);
+		if ((c->flags & MISH_CLIENT_SEARCHING) &&
+				_mish_backlog_search_done(c->search))
+			_mish_client_search_done(m, c);
 
 		if (!c->sending) {
 			/* we're starting up, pool the backlog for a line to display */
 			if (!c->bottom) {
-				c->bottom = TAILQ_LAST(&m->backlog.log, mish_line_queue_t);
+				c->bottom = _mish_backlog_last(&m->backlog);
 				c->sending = c->bottom;
 			} else {
 				// we WERE at the bottom, so find a possible next line
-				mish_line_p next = TAILQ_NEXT(c->bottom, self);
+				uint64_t next = _mish_backlog_next(&m->backlog, c->bottom);
 				if (next) {
 					c->sending = next;
-					c->bottom = TAILQ_LAST(&m->backlog.log, mish_line_queue_t);
+					c->bottom = _mish_backlog_last(&m->backlog);
 				}
 			}
 		}
@@ -319,10 +373,19 @@ _mish_client_dumb_cr(
 			continue;
 
 		do {
-			_mish_send_queue_line(c, c->sending);
+			// lines that are still being overwritten wait until they're done
+			mish_backlog_line_p l = _mish_backlog_get(&m->backlog,
+											c->sending, NULL);
+			if (l && (l->flags & MISH_LINE_PARTIAL)) {
+				c->bottom = _mish_backlog_prev(&m->backlog, c->sending);
+				c->sending = 0;
+				break;
+			}
+			if (!c->filter || _mish_filter_shows(m, c->filter, c->sending))
+				_mish_send_queue_line(c, c->sending);
 			// if we reach the bottom mark, stop
 			c->sending = c->sending == c->bottom ?
-					NULL : TAILQ_NEXT(c->sending, self);
+					0 : _mish_backlog_next(&m->backlog, c->sending);
 		} while (c->sending);
 
 		while (_mish_send_flush(m, c))
@@ -382,3 +445,102 @@ MISH_CMD_HELP(disconnect,
 		"Disconnect this telnet session. If appropriate");
 MISH_CMD_REGISTER_KIND(disconnect, _mish_cmd_disconnect, 0, MISH_CLIENT_CMD_KIND);
 
+
+void
+_mish_client_goto(
+		mish_client_p c,
+		uint64_t seq)
+{
+	mish_p m = c->mish;
+	// the bottom row of the scrolling area is where the next line goes
+	int rows = c->window_size.h - c->footer_height - 1 -
+					_mish_client_line_rows(m, c, seq);
+	uint64_t next;
+
+	// the filter might not show that one, the one before it will do
+	if (c->filter && !_mish_filter_shows(m, c->filter, seq)) {
+		next = _mish_client_prev(m, c, seq);
+		seq = next ? next : _mish_client_next(m, c, seq);
+		if (!seq) {
+			c->bottom = 0;
+			c->flags |= MISH_CLIENT_SCROLLING | MISH_CLIENT_UPDATE_WINDOW;
+			return;
+		}
+	}
+	c->bottom = seq;
+	while ((next = _mish_client_next(m, c, c->bottom)) &&
+			_mish_client_line_rows(m, c, next) <= rows) {
+		rows -= _mish_client_line_rows(m, c, next);
+		c->bottom = next;
+	}
+	// not a screen worth after it, that's just the end
+	if (!next)
+		c->bottom = 0;
+	if (c->bottom)
+		c->flags &= ~MISH_CLIENT_SCROLLING;
+	else
+		c->flags |= MISH_CLIENT_SCROLLING;
+	c->flags |= MISH_CLIENT_UPDATE_WINDOW;
+}
+
+static void
+_mish_cmd_goto(
+		void * param,
+		int argc,
+		const char * argv[])
+{
+	mish_client_p c = param;
+	mish_backlog_p b = &c->mish->backlog;
+
+	if (c->cr.process != _mish_client_interractive_cr) {
+		printf(MISH_COLOR_RED
+				"mish: goto needs an interactive terminal"
+				MISH_COLOR_RESET "\n");
+		return;
+	}
+	uint64_t last = _mish_backlog_last(b);
+	if (argc < 2 || !last) {
+		printf(MISH_COLOR_GREEN
+				"mish: lines %llu to %llu"
+				MISH_COLOR_RESET "\n",
+				(unsigned long long)b->head, (unsigned long long)last);
+		return;
+	}
+	int hh, mm, ss = 0;
+	char * e = NULL;
+	unsigned long long v = strtoull(argv[1], &e, 10);
+	uint64_t seq;
+
+	if (sscanf(argv[1], "%d:%d:%d", &hh, &mm, &ss) >= 2) {
+		// that time today, unless it's not happened yet
+		time_t now = time(NULL), t;
+		struct tm tm;
+		localtime_r(&now, &tm);
+		tm.tm_hour = hh;
+		tm.tm_min = mm;
+		tm.tm_sec = ss;
+		t = mktime(&tm);
+		if (t > now)
+			t -= 24 * 60 * 60;
+		seq = _mish_backlog_find_stamp(b, t * 1000ULL);
+	} else if (e != argv[1] && *e == '%') {
+		if (v > 100)
+			v = 100;
+		seq = b->head + ((last - b->head) * v) / 100;
+	} else if (e != argv[1] && !*e) {
+		seq = v < b->head ? b->head : v > last ? last : v;
+	} else {
+		printf(MISH_COLOR_RED
+				"mish: goto: '%s' isn't a line, percent or time"
+				MISH_COLOR_RESET "\n", argv[1]);
+		return;
+	}
+	_mish_client_goto(c, seq);
+}
+
+MISH_CMD_NAMES(goto, "goto");
+MISH_CMD_HELP(goto,
+		"[<line>|<percent>%|<hh:mm[:ss]>] Scroll back to that line.",
+		"The time is today's, or yesterday's if it's not that time yet;",
+		"without argument, show what lines are in the backlog.");
+MISH_CMD_REGISTER_KIND(goto, _mish_cmd_goto, 0, MISH_CLIENT_CMD_KIND);
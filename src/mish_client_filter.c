@@ -0,0 +1,284 @@
+/*
+ * mish_client_filter.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mish_priv.h"
+#include "mish.h"
+
+/*
+ * Return the cache entry for line 'seq', making room for it; the lines that
+ * were trimmed from the backlog are dropped from the cache when it grows.
+ */
+static uint8_t *
+_mish_filter_cache(
+		mish_backlog_p b,
+		mish_filter_p f,
+		uint64_t seq,
+		int * shift)
+{
+	uint64_t i = seq - f->base;
+
+	if (i >= f->size) {
+		// keep 4 lines per byte aligned, it's just a memmove then
+		uint64_t drop = (b->head - f->base) & ~3ULL;
+		if (drop) {
+			size_t keep = drop / 4 < f->size / 4 ? f->size / 4 - drop / 4 : 0;
+			memmove(f->cache, f->cache + drop / 4, keep);
+			memset(f->cache + keep, 0, f->size / 4 - keep);
+			f->base += drop;
+			i -= drop;
+		}
+	}
+	if (i >= f->size) {
+		size_t size = f->size ? f->size : 4096;
+		while (size <= i)
+			size *= 2;
+		f->cache = realloc(f->cache, size / 4);
+		memset(f->cache + f->size / 4, 0, (size - f->size) / 4);
+		f->size = size;
+	}
+	*shift = (i % 4) * 2;
+	return &f->cache[i / 4];
+}
+
+int
+_mish_filter_regexec(
+		regex_t * re,
+		const char * text,
+		size_t len,
+		size_t nmatch,
+		regmatch_t * match)
+{
+	// so 'foo$' works, the lines from a pty end with \r\n
+	while (len && (text[len - 1] == '\n' || text[len - 1] == '\r'))
+		len--;
+#ifdef REG_STARTEND
+	regmatch_t r[nmatch ? nmatch : 1];
+	r[0] = (regmatch_t) { .rm_so = 0, .rm_eo = len };
+	if (regexec(re, text, nmatch ? nmatch : 1, r, REG_STARTEND))
+		return 0;
+	if (nmatch)
+		memcpy(match, r, sizeof(r));
+	return 1;
+#else
+	static char line[MISH_MAX_LINE_SIZE + 1];
+	memcpy(line, text, len);
+	line[len] = 0;
+	return !regexec(re, line, nmatch, match, 0);
+#endif
+}
+
+int
+_mish_filter_shows(
+		mish_p m,
+		mish_filter_p f,
+		uint64_t seq)
+{
+	int shift;
+
+	if (!seq || seq < m->backlog.head)
+		return 0;
+	uint8_t * e = _mish_filter_cache(&m->backlog, f, seq, &shift);
+	// bit 0 is 'looked at', bit 1 is 'shown'
+	if ((*e >> shift) & 1)
+		return (*e >> (shift + 1)) & 1;
+
+	const char * text;
+	mish_backlog_line_p l = _mish_backlog_get(&m->backlog, seq, &text);
+	if (!l)
+		return 0;
+	int show = !f->err || (l->flags & MISH_LINE_ERR);
+	if (show && f->has_re)
+		show = _mish_filter_regexec(&f->re, text, l->len, 0, NULL);
+	show ^= f->invert;
+	*e |= (1 | (show << 1)) << shift;
+	return show;
+}
+
+/*
+ * Walking forward from the last line shown to the new ones would look at
+ * the same hidden lines every time, so the last run of hidden lines we
+ * went thru is remembered, and skipped over in one go.
+ */
+uint64_t
+_mish_filter_next(
+		mish_p m,
+		mish_filter_p f,
+		uint64_t seq)
+{
+	mish_backlog_p b = &m->backlog;
+	uint64_t from = _mish_backlog_next(b, seq), s = from;
+
+	if (s && s >= f->hidden.from && s < f->hidden.to) {
+		from = f->hidden.from;
+		s = f->hidden.to < b->tail ? f->hidden.to : 0;
+	}
+	while (s && !_mish_filter_shows(m, f, s))
+		s = _mish_backlog_next(b, s);
+	if (from) {
+		f->hidden.from = from;
+		f->hidden.to = s ? s : b->tail;
+	}
+	return s;
+}
+
+uint64_t
+_mish_filter_prev(
+		mish_p m,
+		mish_filter_p f,
+		uint64_t seq)
+{
+	mish_backlog_p b = &m->backlog;
+	uint64_t to = seq, s = _mish_backlog_prev(b, seq);
+
+	if (s && s >= f->hidden.from && s < f->hidden.to) {
+		to = f->hidden.to;
+		s = _mish_backlog_prev(b, f->hidden.from);
+	}
+	while (s && !_mish_filter_shows(m, f, s))
+		s = _mish_backlog_prev(b, s);
+	if (to && (s ? s + 1 : b->head) < to) {
+		f->hidden.from = s ? s + 1 : b->head;
+		f->hidden.to = to;
+	}
+	return s;
+}
+
+void
+_mish_filter_forget(
+		mish_p m,
+		uint64_t seq)
+{
+	mish_filter_p f;
+
+	TAILQ_FOREACH(f, &m->filters, self) {
+		if (seq >= f->base && seq - f->base < f->size)
+			f->cache[(seq - f->base) / 4] &= ~(3 << (((seq - f->base) % 4) * 2));
+		if (seq >= f->hidden.from && seq < f->hidden.to)
+			f->hidden.from = f->hidden.to = 0;
+	}
+}
+
+/*
+ * Return the filter for these arguments, one the other clients use if it's
+ * the same; NULL if the regex doesn't compile.
+ */
+static mish_filter_p
+_mish_filter_get(
+		mish_p m,
+		int argc,
+		const char * argv[])
+{
+	char spec[256] = "";
+	int i;
+
+	for (i = 0; i < argc; i++)
+		snprintf(spec + strlen(spec), sizeof(spec) - strlen(spec),
+				"%s%s", i ? " " : "", argv[i]);
+	mish_filter_p f;
+	TAILQ_FOREACH(f, &m->filters, self) {
+		if (!strcmp(f->spec, spec)) {
+			f->refcount++;
+			return f;
+		}
+	}
+	f = calloc(1, sizeof(*f));
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "-v"))
+			f->invert = 1;
+		else if (!strcmp(argv[i], "stderr"))
+			f->err = 1;
+		else
+			break;
+	}
+	// the regex can have spaces, no need to quote it
+	char re[256] = "";
+	for (int r = i; r < argc; r++)
+		snprintf(re + strlen(re), sizeof(re) - strlen(re),
+				"%s%s", r > i ? " " : "", argv[r]);
+	if (*re) {
+		int err = regcomp(&f->re, re, REG_EXTENDED | REG_NOSUB);
+		if (err) {
+			char msg[128];
+			regerror(err, &f->re, msg, sizeof(msg));
+			printf(MISH_COLOR_RED "mish: filter '%s': %s"
+					MISH_COLOR_RESET "\n", re, msg);
+			free(f);
+			return NULL;
+		}
+		f->has_re = 1;
+	}
+	f->spec = strdup(spec);
+	f->refcount = 1;
+	f->base = m->backlog.head;
+	TAILQ_INSERT_TAIL(&m->filters, f, self);
+	return f;
+}
+
+void
+_mish_filter_release(
+		mish_p m,
+		mish_filter_p f)
+{
+	if (!f || --f->refcount)
+		return;
+	TAILQ_REMOVE(&m->filters, f, self);
+	if (f->has_re)
+		regfree(&f->re);
+	free(f->cache);
+	free(f->spec);
+	free(f);
+}
+
+static void
+_mish_cmd_filter(
+		void * param,
+		int argc,
+		const char * argv[])
+{
+	mish_client_p c = param;
+	mish_p m = c->mish;
+	mish_filter_p f = NULL;
+
+	if (argc > 1 && !(f = _mish_filter_get(m, argc - 1, argv + 1)))
+		return;
+	if (!f && !c->filter) {
+		printf(MISH_COLOR_GREEN "mish: no filter" MISH_COLOR_RESET "\n");
+		return;
+	}
+	_mish_filter_release(m, c->filter);
+	c->filter = f;
+	if (f)
+		printf(MISH_COLOR_GREEN "mish: filter '%s'%s"
+				MISH_COLOR_RESET "\n", f->spec,
+				f->refcount > 1 ? ", shared" : "");
+	else
+		printf(MISH_COLOR_GREEN "mish: filter off" MISH_COLOR_RESET "\n");
+	if (c->cr.process != _mish_client_interractive_cr)
+		return;
+	// stay where we were, on the nearest line we still show
+	if (c->flags & MISH_CLIENT_SCROLLING)
+		c->bottom = 0;
+	else if (c->bottom && f && !_mish_filter_shows(m, f, c->bottom)) {
+		uint64_t near = _mish_client_prev(m, c, c->bottom);
+		c->bottom = near ? near : _mish_client_next(m, c, c->bottom);
+		if (!c->bottom)
+			c->flags |= MISH_CLIENT_SCROLLING;
+	}
+	c->flags |= MISH_CLIENT_UPDATE_WINDOW;
+}
+
+MISH_CMD_NAMES(filter, "filter");
+MISH_CMD_HELP(filter,
+		"[-v] [stderr] [regex] Only show the lines that match.",
+		"'stderr' only shows what was printed on stderr, '-v' shows the",
+		"lines that don't match instead. Without arguments, show them all.",
+		"Each terminal has its own filter.");
+MISH_CMD_REGISTER_KIND(filter, _mish_cmd_filter, 0, MISH_CLIENT_CMD_KIND);
@@ -14,223 +14,338 @@
 #include "mish_priv_cmd.h"
 #include "mish.h"
 
+/*
+ * Make sure the command being edited has room for 'count' more characters
+ */
+static void
+_mish_client_cmd_reserve(
+		mish_input_p in,
+		mish_client_p c,
+		unsigned int count)
+{
+	// if no command is editing, create an empty one, add it to history
+	if (!c->cmd) {
+		_mish_line_reserve(&c->cmd, count);
+		TAILQ_INSERT_TAIL(&in->backlog, c->cmd, self);
+		return;
+	}
+	if (c->cmd->size - c->cmd->len > count)
+		return;
+	/*
+	 * we need to detach the element if we're going to resize it,
+	 * otherwise the list is completely fubar as the pointer changes
+	 */
+	mish_line_p next = TAILQ_NEXT(c->cmd, self);
+	TAILQ_REMOVE(&in->backlog, c->cmd, self);
+	_mish_line_reserve(&c->cmd, count);
+	if (next)
+		TAILQ_INSERT_BEFORE(next, c->cmd, self);
+	else
+		TAILQ_INSERT_TAIL(&in->backlog, c->cmd, self);
+}
+
+/*
+ * Insert 'l' characters at the cursor of the command being edited, and echo
+ * them; the terminal is in insert mode, so that's all it takes.
+ */
+static void
+_mish_client_cmd_insert(
+		mish_input_p in,
+		mish_client_p c,
+		const char * text,
+		unsigned int l)
+{
+	_mish_client_cmd_reserve(in, c, l + 1);
+	// lines have a maximum size, drop what doesn't fit
+	if (c->cmd->size - c->cmd->len <= l)
+		l = c->cmd->size - c->cmd->len - 1;
+	if (!l)
+		return;
+	memmove(c->cmd->line + c->cmd->done + l,
+			c->cmd->line + c->cmd->done,
+			c->cmd->len - c->cmd->done + 1);
+	memcpy(c->cmd->line + c->cmd->done, text, l);
+	c->cmd->done += l;
+	c->cmd->len += l;
+	_mish_send_queue_span(c, text, l);
+}
+
+// the decoder gives us the code point, the line has it as UTF8
+static void
+_mish_client_cmd_insert_glyph(
+		mish_input_p in,
+		mish_client_p c,
+		uint32_t g)
+{
+	char u[4];
+	int l = 0;
+
+	if (g < 0x80)
+		u[l++] = g;
+	else if (g < 0x800) {
+		u[l++] = 0xc0 | (g >> 6);
+		u[l++] = 0x80 | (g & 0x3f);
+	} else if (g < 0x10000) {
+		u[l++] = 0xe0 | (g >> 12);
+		u[l++] = 0x80 | ((g >> 6) & 0x3f);
+		u[l++] = 0x80 | (g & 0x3f);
+	} else {
+		u[l++] = 0xf0 | (g >> 18);
+		u[l++] = 0x80 | ((g >> 12) & 0x3f);
+		u[l++] = 0x80 | ((g >> 6) & 0x3f);
+		u[l++] = 0x80 | (g & 0x3f);
+	}
+	_mish_client_cmd_insert(in, c, u, l);
+}
+
 /*
  * Don't assume this handles every key combination in the world, it doesn't,
  * it handles mostly the one I use most from bash!
  * You like VI syntax, saaaaad story :-)
  */
-//! Parse current input buffer
-int
-_mish_client_vt_parse_input(
-		struct mish_t *m,
-		struct mish_input_t *in,
-		uint8_t ich)
+static void
+_mish_client_vt_char(
+		mish_p m,
+		mish_input_p in,
+		mish_client_p c,
+		uint8_t ch)
 {
-	mish_client_p c = in->refcon;
-
+	if (in->is_telnet && _mish_telnet_parse(c, ch))
+		return;
+	if (!_mish_vt_sequence_char(&c->vts, ch))
+		return;
+	_mish_client_cmd_reserve(in, c, 4);
 	/*
-	 * if the sequence buffer is currently being flushed, we need to store
-	 * the input until it's done.
-	 * So lets store it into the input buffer, and once that output is finished
-	 * we can process it as before.
+	 * Bracketed paste; everything is text until the end marker, and it
+	 * all goes on the one line.
 	 */
-	if (c->output.sqb->done)
-		return MISH_IN_STORE;
-	// now flush what was stored, plus the one we just received
-	for (int i = 0; i <= in->line->done; i++) {
-		uint8_t ch = i == in->line->done ? ich : in->line->line[i];
-
-		if (in->is_telnet) {
-			if (_mish_telnet_parse(c, ch))
-				continue;
-		}
-		if (!_mish_vt_sequence_char(&c->vts, ch))
-			continue;
-		// if no command is editing, create an empty one, add it to history
-		if (!c->cmd) {
-			_mish_line_reserve(&c->cmd, 4);
-			TAILQ_INSERT_TAIL(&in->backlog, c->cmd, self);
-		} else {
-			/*
-			 * we need to detach the element if we're going to resize it,
-			 * otherwise the list is completely fubar as the pointer changes
-			 */
-			if (c->cmd->size - c->cmd->len <= 4) {
-				mish_line_p next = TAILQ_NEXT(c->cmd, self);
-				TAILQ_REMOVE(&in->backlog, c->cmd, self);
-				_mish_line_reserve(&c->cmd, 4);
-				if (next)
-					TAILQ_INSERT_BEFORE(next, c->cmd, self);
-				else
-					TAILQ_INSERT_TAIL(&in->backlog, c->cmd, self);
-			}
-		}
-		switch (c->vts.seq) {
-			case MISH_VT_SEQ(CSI, '~'): {
-				mish_line_p cursor = c->bottom;
-				if (c->vts.p[0] == 1)	// GNU screen HOME seq
-					goto kb_home;
-				else if (c->vts.p[0] == 4)	// GNU screen END seq
-					goto kb_end;
-				if (c->vts.p[0] == 5) { // Page UP
-					for (int i = 0; i < c->window_size.h - 3 && cursor; i++)
-						cursor = TAILQ_PREV(cursor, mish_line_queue_t, self);
-					if (cursor) {
-						c->bottom = cursor;
-						c->flags |= MISH_CLIENT_UPDATE_WINDOW;
-						c->flags &= ~MISH_CLIENT_SCROLLING;
-					}
-				} else if (c->vts.p[0] == 6) {	// down
-					for (int i = 0; i < c->window_size.h - 3 && cursor; i++)
-						cursor = TAILQ_NEXT(cursor, self);
-					c->bottom = cursor;
+	if (c->flags & MISH_CLIENT_PASTE) {
+		uint32_t g = c->vts.glyph;
+		if (c->vts.seq == MISH_VT_SEQ(CSI, '~') && c->vts.p[0] == 201)
+			c->flags &= ~MISH_CLIENT_PASTE;
+		else if (g == '\t' || g == '\r' || g == '\n')
+			_mish_client_cmd_insert(in, c, " ", 1);
+		else if (g >= ' ' && g != 0x7f)
+			_mish_client_cmd_insert_glyph(in, c, g);
+		return;
+	}
+	// after a search, n/N go thru the hits, if there's no command typed
+	if ((c->flags & MISH_CLIENT_SEARCH) && !c->cmd->len &&
+			_mish_client_search_key(m, c, c->vts.glyph))
+		return;
+	switch (c->vts.seq) {
+		case MISH_VT_SEQ(CSI, '~'): {
+			int page = c->window_size.h - 3;
+			if (c->vts.p[0] == 200)	// start of bracketed paste
+				c->flags |= MISH_CLIENT_PASTE;
+			else if (c->vts.p[0] == 1)	// GNU screen HOME seq
+				goto kb_home;
+			else if (c->vts.p[0] == 4)	// GNU screen END seq
+				goto kb_end;
+			// pages are in screen rows, long lines take more than one
+			if (c->vts.p[0] == 5) { // Page UP
+				// only if there's a whole page above us
+				uint64_t up = _mish_client_walk_rows(m, c, c->bottom, -page);
+				if (up) {
+					c->bottom = up;
 					c->flags |= MISH_CLIENT_UPDATE_WINDOW;
-					if (!c->bottom)
-						c->flags |= MISH_CLIENT_SCROLLING;
-				}
-			}	break;
-			case MISH_VT_SEQ(CSI, 'H'): {	// Home
-kb_home:
-				// don't bother if there's not enough backlog
-				if (m->backlog.size < c->window_size.h - 2)
-					break;
-				c->bottom = TAILQ_FIRST(&m->backlog.log);
-				for (i = 0; i < c->window_size.h - 2 - 1 && c->bottom; i++)
-					c->bottom = TAILQ_NEXT(c->bottom, self);
-				c->flags |= MISH_CLIENT_UPDATE_WINDOW;
-				if (c->bottom)
 					c->flags &= ~MISH_CLIENT_SCROLLING;
-			}	break;
-			case MISH_VT_SEQ(CSI, 'F'): {	// END
-kb_end:
-				c->flags |= MISH_CLIENT_UPDATE_WINDOW | MISH_CLIENT_SCROLLING;
-				c->bottom = NULL;
-			}	break;
-			case MISH_VT_SEQ(CSI, 'R'):
-				c->flags |= MISH_CLIENT_HAS_CURSOR_POS;
-				c->cursor_pos.y = c->vts.p[0];
-				c->cursor_pos.x = c->vts.p[1];
-				break;
-			case MISH_VT_SEQ(RAW, 16): {		// CTRL-P	Prev history
-				if (TAILQ_FIRST(&in->backlog) != c->cmd) {
-					c->flags |= MISH_CLIENT_UPDATE_PROMPT;
-					c->cmd = TAILQ_PREV(c->cmd, mish_line_queue_t, self);
-				}
-			}	break;
-			case MISH_VT_SEQ(RAW, 14): 		// CTRL-N 	Next history
-				if (TAILQ_LAST(&in->backlog, mish_line_queue_t) != c->cmd) {
-					c->flags |= MISH_CLIENT_UPDATE_PROMPT;
-					c->cmd = TAILQ_NEXT(c->cmd, self);
-				}
-				break;
-			case MISH_VT_SEQ(RAW, 1): 		// CTRL-A	Start of line
-				if (c->cmd->done) {
-					_mish_send_queue_fmt(c, "\033[%dD", c->cmd->done);
-					c->cmd->done = 0;
-				}
-				break;
-			case MISH_VT_SEQ(RAW, 5): 		// CTRL-E	End of Line
-				if (c->cmd->done < c->cmd->len) {
-					_mish_send_queue_fmt(c, "\033[%dC",
-							c->cmd->len - c->cmd->done);
-					c->cmd->done = c->cmd->len;
-				}
-				break;
-			case MISH_VT_SEQ(RAW, 2): 		// CTRL-B	Prev char
-				if (c->cmd->done) {
-					c->cmd->done--;
-					_mish_send_queue_fmt(c, "\033[%dD", 1);
-				}
-				break;
-			case MISH_VT_SEQ(RAW, 6): 		// CTRL-F	Next Char
-				if (c->cmd->done < c->cmd->len) {
-					c->cmd->done++;
-					_mish_send_queue_fmt(c, "\033[%dC", 1);
-				}
-				break;
-			case MISH_VT_SEQ(RAW, 23): {		// CTRL-W Delete prev word
-				int old_pos = c->cmd->done;
-				while (c->cmd->done && c->cmd->line[c->cmd->done-1] == ' ')
-					c->cmd->done--;
-				while (c->cmd->done && c->cmd->line[c->cmd->done-1] != ' ')
-					c->cmd->done--;
-
-				if (old_pos - c->cmd->done) {
-					int del = old_pos - c->cmd->done;
-					memmove(c->cmd->line + c->cmd->done,
-							c->cmd->line + old_pos,
-							c->cmd->len - old_pos + 1);
-					c->cmd->len -= del;
-					// move back del characters, and delete them
-					_mish_send_queue_fmt(c, "\033[%dD\033[%dP", del, del);
-				}
-			}	break;
-			case MISH_VT_SEQ(RAW, 0x7f): 	// DEL
-			case MISH_VT_SEQ(RAW, 8): 		// CTRL-H
-				if (c->cmd->done) {
-					c->cmd->done--;
-					memmove(c->cmd->line + c->cmd->done,
-							c->cmd->line + c->cmd->done + 1,
-							c->cmd->len - c->cmd->done + 1);
-					c->cmd->len--;
-					// backspace plus Delete (1) Character
-					_mish_send_queue(c, "\x8\033[P");
 				}
-				break;
-			case MISH_VT_SEQ(RAW, 11): 		// CTRL-K	Kill rest of line
-				c->cmd->len = c->cmd->done;
-				c->cmd->line[c->cmd->len] = 0;
-				_mish_send_queue(c, "\033[K");
-				break;
-			case MISH_VT_SEQ(RAW, 12): 		// CTRL-L	Redraw
+			} else if (c->vts.p[0] == 6) {	// down
+				c->bottom = _mish_client_walk_rows(m, c, c->bottom, page);
 				c->flags |= MISH_CLIENT_UPDATE_WINDOW;
+				if (!c->bottom)
+					c->flags |= MISH_CLIENT_SCROLLING;
+			}
+		}	break;
+		case MISH_VT_SEQ(CSI, 'H'): {	// Home
+			uint64_t home;
+kb_home:
+			// don't bother if there's not enough backlog
+			home = _mish_client_walk_rows(m, c, m->backlog.head,
+								c->window_size.h - 2 - 1);
+			if (!home)
 				break;
-			case MISH_VT_SEQ(RAW, 13): 		// CTRL-M aka return
-				c->cmd->line[c->cmd->len] = 0;
-				if (0) {	// debug
-					fprintf(stdout, "CMD: '%.*s", c->cmd->done, c->cmd->line);
-					fprintf(stdout, "\033[7m%.*s\033[0m", 1,
-							c->cmd->line + c->cmd->done);
-					if (c->cmd->done < c->cmd->len)
-						fprintf(stdout, "%s", c->cmd->line + c->cmd->done+1);
-					fprintf(stdout, "'\n");
-				}
-				// if we have a non-safe command, we need to signal the
-				// cmd execution thread, so mark the client as having a command
-				if (mish_cmd_call(c->cmd->line, c) == 1)
-					c->flags |= MISH_CLIENT_HAS_CMD;
-				c->cmd = NULL;	// new one
-				{	// reuse the last empty one
-					mish_line_p last = TAILQ_LAST(&in->backlog, mish_line_queue_t);
-					if (last && last->len == 0)
-						c->cmd = last;
-				}
+			c->bottom = home;
+			c->flags |= MISH_CLIENT_UPDATE_WINDOW;
+			c->flags &= ~MISH_CLIENT_SCROLLING;
+		}	break;
+		case MISH_VT_SEQ(CSI, 'F'): {	// END
+kb_end:
+			c->flags |= MISH_CLIENT_UPDATE_WINDOW | MISH_CLIENT_SCROLLING;
+			c->bottom = 0;
+		}	break;
+		case MISH_VT_SEQ(CSI, 'R'):
+			c->flags |= MISH_CLIENT_HAS_CURSOR_POS;
+			c->cursor_pos.y = c->vts.p[0];
+			c->cursor_pos.x = c->vts.p[1];
+			break;
+		case MISH_VT_SEQ(RAW, 16): {		// CTRL-P	Prev history
+			if (TAILQ_FIRST(&in->backlog) != c->cmd) {
 				c->flags |= MISH_CLIENT_UPDATE_PROMPT;
+				c->cmd = TAILQ_PREV(c->cmd, mish_line_queue_t, self);
+			}
+		}	break;
+		case MISH_VT_SEQ(RAW, 14): 		// CTRL-N 	Next history
+			if (TAILQ_LAST(&in->backlog, mish_line_queue_t) != c->cmd) {
+				c->flags |= MISH_CLIENT_UPDATE_PROMPT;
+				c->cmd = TAILQ_NEXT(c->cmd, self);
+			}
+			break;
+		case MISH_VT_SEQ(RAW, 1): 		// CTRL-A	Start of line
+			if (c->cmd->done) {
+				_mish_send_queue_fmt(c, "\033[%dD", c->cmd->done);
+				c->cmd->done = 0;
+			}
+			break;
+		case MISH_VT_SEQ(RAW, 5): 		// CTRL-E	End of Line
+			if (c->cmd->done < c->cmd->len) {
+				_mish_send_queue_fmt(c, "\033[%dC",
+						c->cmd->len - c->cmd->done);
+				c->cmd->done = c->cmd->len;
+			}
+			break;
+		case MISH_VT_SEQ(RAW, 2): 		// CTRL-B	Prev char
+			if (c->cmd->done) {
+				c->cmd->done--;
+				_mish_send_queue_fmt(c, "\033[%dD", 1);
+			}
+			break;
+		case MISH_VT_SEQ(RAW, 6): 		// CTRL-F	Next Char
+			if (c->cmd->done < c->cmd->len) {
+				c->cmd->done++;
+				_mish_send_queue_fmt(c, "\033[%dC", 1);
+			}
+			break;
+		case MISH_VT_SEQ(RAW, 23): {		// CTRL-W Delete prev word
+			int old_pos = c->cmd->done;
+			while (c->cmd->done && c->cmd->line[c->cmd->done-1] == ' ')
+				c->cmd->done--;
+			while (c->cmd->done && c->cmd->line[c->cmd->done-1] != ' ')
+				c->cmd->done--;
+
+			if (old_pos - c->cmd->done) {
+				int del = old_pos - c->cmd->done;
+				memmove(c->cmd->line + c->cmd->done,
+						c->cmd->line + old_pos,
+						c->cmd->len - old_pos + 1);
+				c->cmd->len -= del;
+				// move back del characters, and delete them
+				_mish_send_queue_fmt(c, "\033[%dD\033[%dP", del, del);
+			}
+		}	break;
+		case MISH_VT_SEQ(RAW, 0x7f): 	// DEL
+		case MISH_VT_SEQ(RAW, 8): 		// CTRL-H
+			if (c->cmd->done) {
+				c->cmd->done--;
+				memmove(c->cmd->line + c->cmd->done,
+						c->cmd->line + c->cmd->done + 1,
+						c->cmd->len - c->cmd->done + 1);
+				c->cmd->len--;
+				// backspace plus Delete (1) Character
+				_mish_send_queue(c, "\x8\033[P");
+			}
+			break;
+		case MISH_VT_SEQ(RAW, 11): 		// CTRL-K	Kill rest of line
+			c->cmd->len = c->cmd->done;
+			c->cmd->line[c->cmd->len] = 0;
+			_mish_send_queue(c, "\033[K");
+			break;
+		case MISH_VT_SEQ(RAW, 9): {		// TAB	Complete command name
+			// only the first word is a command
+			if (memchr(c->cmd->line, ' ', c->cmd->done))
 				break;
-			default:
-				if (c->vts.seq & ~0xff) {
-					printf(MISH_COLOR_RED
-							"mish: Unknown sequence: %08x ", c->vts.seq);
-					for (int i = 0; i < c->vts.pc; i++)
-						printf(":%d", c->vts.p[i]);
-					printf("'%c%c'", c->vts.seq >> 8, c->vts.seq & 0xff);
-					printf(MISH_COLOR_RESET "\n");
-				}
-				break;
-		}
-		if (c->vts.glyph && c->vts.glyph >= ' ' && c->vts.glyph < 0x7f) {
-			memmove(c->cmd->line + c->cmd->done + 1,
-					c->cmd->line + c->cmd->done,
-					c->cmd->len - c->cmd->done);
-			c->cmd->line[c->cmd->done] = c->vts.glyph;
-			c->cmd->done++;
-			c->cmd->len++;
+			char add[64];
+			int n = _mish_cmd_complete(c->cmd->line, c->cmd->done,
+							add, sizeof(add) - 1);
+			int l = strlen(add);
+			if (n == 1 && c->cmd->done == c->cmd->len)
+				add[l++] = ' ';	// like bash, it's a whole name
+			if (n && l)
+				_mish_client_cmd_insert(in, c, add, l);
+		}	break;
+		case MISH_VT_SEQ(RAW, 12): 		// CTRL-L	Redraw
+			_mish_screen_forget(c);
+			c->flags |= MISH_CLIENT_UPDATE_WINDOW | MISH_CLIENT_UPDATE_PROMPT;
+			break;
+		case MISH_VT_SEQ(RAW, 13): 		// CTRL-M aka return
 			c->cmd->line[c->cmd->len] = 0;
-			// no need to explicitly insert, terminal should already be setup
-			_mish_send_queue_fmt(c, "%lc", c->vts.glyph);
+			if (0) {	// debug
+				fprintf(stdout, "CMD: '%.*s", c->cmd->done, c->cmd->line);
+				fprintf(stdout, "\033[7m%.*s\033[0m", 1,
+						c->cmd->line + c->cmd->done);
+				if (c->cmd->done < c->cmd->len)
+					fprintf(stdout, "%s", c->cmd->line + c->cmd->done+1);
+				fprintf(stdout, "'\n");
+			}
+			// queued commands wake up whoever runs them
+			if (c->cmd->line[0] == '/')
+				_mish_client_search(m, c, c->cmd->line + 1);
+			else
+				mish_cmd_call(c->cmd->line, c);
+			c->cmd = NULL;	// new one
+			{	// reuse the last empty one
+				mish_line_p last = TAILQ_LAST(&in->backlog, mish_line_queue_t);
+				if (last && last->len == 0)
+					c->cmd = last;
+			}
+			c->flags |= MISH_CLIENT_UPDATE_PROMPT;
+			break;
+		default:
+			if (c->vts.seq & ~0xff) {
+				printf(MISH_COLOR_RED
+						"mish: Unknown sequence: %08x ", c->vts.seq);
+				for (int i = 0; i < c->vts.pc; i++)
+					printf(":%d", c->vts.p[i]);
+				printf("'%c%c'", c->vts.seq >> 8, c->vts.seq & 0xff);
+				printf(MISH_COLOR_RESET "\n");
+			}
+			break;
+	}
+	if (c->vts.glyph && c->vts.glyph >= ' ' && c->vts.glyph < 0x7f) {
+		char g = c->vts.glyph;
+		_mish_client_cmd_insert(in, c, &g, 1);
+	}
+}
+
+/*
+ * This is the process() callback of the client input, it gets all the
+ * data that was read, and consumes it in one pass. Runs of plain text are
+ * inserted (and echoed) in one go, it's only the rest that needs to go thru
+ * the sequence decoder one byte at a time.
+ */
+int
+_mish_client_vt_parse_input(
+		struct mish_t *m,
+		struct mish_input_t *in)
+{
+	mish_client_p c = in->refcon;
+
+	/*
+	 * if the sequence buffer is currently being flushed, we can't echo
+	 * anything; keep the input until that output is finished, the client
+	 * coroutine calls us again then.
+	 */
+	if (c->output.sqb && c->output.sqb->done) {
+		in->line->done = in->line->len;
+		return 0;
+	}
+	const uint8_t * s = (uint8_t*)in->line->line;
+	const uint8_t * e = s + in->line->len;
+	while (s < e) {
+		// only if the decoder (and telnet) isn't half way thru a sequence,
+		// and the keys aren't search keys
+		if ((c->vts.done || c->vts.seq == MISH_VT_RAW) &&
+				!(c->flags & MISH_CLIENT_SEARCH)) {
+			const uint8_t * r = _mish_vt_text_run(s, e);
+			if (r > s) {
+				_mish_client_cmd_insert(in, c, (const char*)s, r - s);
+				s = r;
+				continue;
+			}
 		}
+		_mish_client_vt_char(m, in, c, *s++);
 	}
-	// remove any buffered input.
-	in->line->len = 0;
-	return MISH_IN_SKIP;
+	in->line->len = in->line->done = 0;
+	return 1;
 }
@@ -0,0 +1,244 @@
+/*
+ * mish_client_screen.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mish_priv.h"
+#include "mish.h"
+
+/*
+ * Each interactive client remembers what the rows of its scrolling area
+ * show, as a key made from the line, and which row of it that is; so when
+ * the window has to be redrawn, only the rows that changed are sent. If
+ * the view just moved by a few lines, the terminal scrolls them instead.
+ */
+// a row we don't know the content of, it's different from anything
+#define MISH_SCREEN_UNKNOWN		(~0ULL)
+// the peer says how big the window is, don't believe it too much
+#define MISH_SCREEN_MAX_ROWS	1024
+// views that moved further than that are drawn again, not scrolled
+#define MISH_SCREEN_MAX_SCROLL	8
+
+/*
+ * The key of a row is the line and the row in it, a line only changes
+ * with _mish_backlog_replace(), and _mish_screen_changed() is told.
+ */
+static uint64_t
+_mish_screen_key(
+		mish_client_p c,
+		uint64_t seq)
+{
+	uint64_t h = seq << 1;
+	// the search hit we're on looks different
+	if ((c->flags & MISH_CLIENT_SEARCH) &&
+			c->search->hit[c->search_hit] == seq)
+		h |= 1;
+	// the low bits are for the row in the line, never 0
+	return h << 16;
+}
+
+/*
+ * Make sure there's a row for each of the scrolling area, they start as
+ * 'unknown'; returns 1 if the window size changed.
+ */
+static int
+_mish_screen_size(
+		mish_client_p c)
+{
+	int h = c->window_size.h - c->footer_height;
+
+	if (h < 1)
+		h = 1;
+	if (h > MISH_SCREEN_MAX_ROWS)
+		h = MISH_SCREEN_MAX_ROWS;
+	if (c->screen.row && c->screen.h == h && c->screen.w == c->window_size.w)
+		return 0;
+	c->screen.row = realloc(c->screen.row, (h + 1) * sizeof(c->screen.row[0]));
+	c->screen.h = h;
+	c->screen.w = c->window_size.w;
+	for (int r = 0; r <= h; r++)
+		c->screen.row[r] = MISH_SCREEN_UNKNOWN;
+	return 1;
+}
+
+// the area scrolled 'count' rows up (or down if < 0), like the terminal
+static void
+_mish_screen_scroll(
+		mish_client_p c,
+		int count)
+{
+	uint64_t * row = c->screen.row + 1;
+	int h = c->screen.h;
+
+	if (count >= h || -count >= h) {
+		memset(row, 0, h * sizeof(row[0]));
+	} else if (count > 0) {
+		memmove(row, row + count, (h - count) * sizeof(row[0]));
+		memset(row + h - count, 0, count * sizeof(row[0]));
+	} else if (count < 0) {
+		memmove(row - count, row, (h + count) * sizeof(row[0]));
+		memset(row, 0, -count * sizeof(row[0]));
+	}
+}
+
+void
+_mish_screen_forget(
+		mish_client_p c)
+{
+	for (int r = 0; c->screen.row && r <= c->screen.h; r++)
+		c->screen.row[r] = MISH_SCREEN_UNKNOWN;
+}
+
+void
+_mish_screen_changed(
+		mish_client_p c,
+		uint64_t seq)
+{
+	for (int r = 1; c->screen.row && r <= c->screen.h; r++)
+		if (c->screen.row[r] != MISH_SCREEN_UNKNOWN &&
+				c->screen.row[r] >> 17 == seq)
+			c->screen.row[r] = MISH_SCREEN_UNKNOWN;
+}
+
+void
+_mish_screen_sent(
+		mish_p m,
+		mish_client_p c,
+		uint64_t seq,
+		int vpos,
+		int rows)
+{
+	if (!c->screen.row)
+		return;
+	int h = c->screen.h;
+	// the last \n at the bottom of the area scrolls it
+	if (vpos + rows > h) {
+		_mish_screen_scroll(c, vpos + rows - h);
+		vpos = h - rows;
+	}
+	uint64_t key = _mish_screen_key(c, seq);
+	for (int i = 0; i < rows; i++)
+		if (vpos + i >= 1)
+			c->screen.row[vpos + i] = key | (i + 1);
+}
+
+void
+_mish_client_queue_line(
+		mish_p m,
+		mish_client_p c,
+		uint64_t seq)
+{
+	mish_backlog_line_p l = _mish_backlog_get(&m->backlog, seq, NULL);
+	if (l && (l->flags & MISH_LINE_ERR))
+		_mish_send_queue(c, MISH_COLOR_RED);
+	// the search hit we're on is highlighted
+	if (!_mish_client_search_line(m, c, seq))
+		_mish_send_queue_line(c, seq);
+	if (l && (l->flags & MISH_LINE_ERR))
+		_mish_send_queue(c, "\033[m");
+}
+
+/*
+ * Draw the window with 'bottom' (or the last line) on the row above the
+ * last one of the scrolling area, that one is where new lines go.
+ */
+void
+_mish_screen_update(
+		mish_p m,
+		mish_client_p c)
+{
+	if (_mish_screen_size(c)) {
+		/* Set the scrolling region to all minus the 2 bottom lines */
+		_mish_send_queue_fmt(c, "\033D\033[1;%dr", c->screen.h);
+		c->flags |= MISH_CLIENT_UPDATE_PROMPT;
+	}
+	int h = c->screen.h;
+	uint64_t * row = c->screen.row;
+	uint64_t want[h + 1];
+	struct {
+		uint64_t seq;
+		int row, rows;
+	} line[h];
+	int count = 0, top = h, cut = 0;
+
+	memset(want, 0, sizeof(want));
+	uint64_t seq = c->bottom ? c->bottom : _mish_client_last(m, c);
+	if (c->flags & MISH_CLIENT_SCROLLING)
+		c->bottom = seq;
+	/*
+	 * Walk back from the 'bottom' line until we reach the top of the
+	 * screen, or ran out of lines. Lines that wrap take more than one row.
+	 */
+	for (; seq; seq = _mish_client_prev(m, c, seq)) {
+		int rows = _mish_client_line_rows(m, c, seq);
+		if (rows > top - 1) {
+			// too long for the screen, it'll be cut at the top
+			if (count)
+				break;
+			rows = top - 1;
+			cut = 1;
+		}
+		top -= rows;
+		uint64_t key = _mish_screen_key(c, seq);
+		for (int i = 0; i < rows; i++)
+			want[top + i] = key | (i + 1);
+		line[count].seq = seq;
+		line[count].row = top;
+		line[count++].rows = rows;
+		if (top <= 1)
+			break;
+	}
+	_mish_send_queue(c, "\033[s\033[4l");
+	/*
+	 * If the lines we want are on screen already, but higher or lower,
+	 * scroll the area by as many rows, then draw what's missing.
+	 */
+	int best = 0, best_count = 0;
+	for (int d = -MISH_SCREEN_MAX_SCROLL; d <= MISH_SCREEN_MAX_SCROLL; d++) {
+		if (d <= -h || d >= h)
+			continue;
+		int same = 0;
+		for (int r = 1; r < h; r++)
+			if (want[r] && r + d >= 1 && r + d < h && want[r] == row[r + d])
+				same++;
+		if (same > best_count || (same == best_count && !d)) {
+			best = d;
+			best_count = same;
+		}
+	}
+	if (best) {
+		_mish_send_queue_fmt(c, "\033[%d%c", best > 0 ? best : -best,
+				best > 0 ? 'S' : 'T');
+		_mish_screen_scroll(c, best);
+	}
+	for (int r = 1; r <= h; r++)
+		if (!want[r] && row[r]) {
+			_mish_send_queue_fmt(c, "\033[%d;1H\033[2K", r);
+			row[r] = 0;
+		}
+	for (int i = count - 1; i >= 0; i--) {
+		int r = line[i].row, changed = 0;
+		for (int j = 0; j < line[i].rows; j++)
+			changed |= row[r + j] != want[r + j];
+		if (!changed)
+			continue;
+		// bottom up, so we end up where the line starts
+		for (int j = line[i].rows - 1; j >= 0; j--) {
+			_mish_send_queue_fmt(c, "\033[%d;1H\033[2K", r + j);
+			row[r + j] = want[r + j];
+		}
+		_mish_client_queue_line(m, c, line[i].seq);
+	}
+	_mish_send_queue(c, "\033[4h\033[u");
+	// it scrolled the area, who knows what's where now
+	if (cut)
+		_mish_screen_forget(c);
+	c->current_vpos = h;
+	c->sending = 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * mish_client_search.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "mish_priv.h"
+#include "mish.h"
+
+// how many hits are printed for the clients that can't scroll to them
+#define MISH_SEARCH_PRINT	20
+
+/*
+ * The searches write a byte in the pipe when they are done; that's just so
+ * the capture thread wakes up, the clients check their search themselves.
+ */
+static int
+_mish_search_wake(
+		struct mish_t *m,
+		struct mish_input_t *in)
+{
+	in->line->len = in->line->done = 0;
+	return 0;
+}
+
+void
+_mish_search_init(
+		mish_p m)
+{
+	int fd[2];
+
+	m->search.fd = -1;
+	if (pipe(fd)) {
+		perror("mish: search pipe");
+		return;
+	}
+	_mish_input_init(m, &m->search.wake, fd[0]);
+	m->search.wake.process = _mish_search_wake;
+	m->search.fd = fd[1];
+	// it doesn't matter if it's full, the capture thread is awake then
+	fcntl(fd[1], F_SETFL, fcntl(fd[1], F_GETFL) | O_NONBLOCK);
+}
+
+void
+_mish_client_search(
+		mish_p m,
+		mish_client_p c,
+		const char * pattern)
+{
+	char * again = NULL;
+
+	if (!*pattern) {
+		if (!c->search) {
+			printf(MISH_COLOR_RED "mish: search for what?"
+					MISH_COLOR_RESET "\n");
+			return;
+		}
+		pattern = again = strdup(c->search->pattern);
+	}
+	_mish_backlog_search_free(c->search);
+	c->search = _mish_backlog_search(&m->backlog, pattern, m->search.fd);
+	c->flags = (c->flags & ~MISH_CLIENT_SEARCH) | MISH_CLIENT_SEARCHING;
+	free(again);
+}
+
+void
+_mish_client_search_done(
+		mish_p m,
+		mish_client_p c)
+{
+	mish_search_p s = c->search;
+
+	c->flags &= ~MISH_CLIENT_SEARCHING;
+	printf(MISH_COLOR_GREEN
+			"mish: %u%s lines match '%s' (%.1fms",
+			s->count, s->truncated ? "+" : "", s->pattern,
+			s->took_us / 1000.0);
+	if (s->skipped)
+		printf(", %u/%u segments looked at", s->seg_count,
+				s->seg_count + s->skipped);
+	printf(")" MISH_COLOR_RESET "\n");
+	if (!s->count)
+		return;
+	if (c->cr.process != _mish_client_interractive_cr) {
+		unsigned int i = s->count > MISH_SEARCH_PRINT ?
+							s->count - MISH_SEARCH_PRINT : 0;
+		for (; i < s->count; i++) {
+			const char * text;
+			mish_backlog_line_p l = _mish_backlog_get(&m->backlog,
+										s->hit[i], &text);
+			if (l)
+				printf("%8llu: %.*s", (unsigned long long)s->hit[i],
+						(int)l->len, text);
+		}
+		return;
+	}
+	/* start with the last hit that is on screen, or above it */
+	uint64_t bottom = c->bottom ? c->bottom : _mish_backlog_last(&m->backlog);
+	c->search_hit = s->count - 1;
+	while (c->search_hit && s->hit[c->search_hit] > bottom)
+		c->search_hit--;
+	c->flags |= MISH_CLIENT_SEARCH;
+	_mish_client_goto(c, s->hit[c->search_hit]);
+}
+
+/*
+ * 'n' goes to the previous (older) hit, 'N' to the next one, like a
+ * backward search in less. Any other key ends it.
+ */
+int
+_mish_client_search_key(
+		mish_p m,
+		mish_client_p c,
+		uint32_t glyph)
+{
+	mish_search_p s = c->search;
+	unsigned int hit = c->search_hit;
+
+	if (glyph == 'n') {
+		if (hit)
+			hit--;
+	} else if (glyph == 'N') {
+		if (hit + 1 < s->count)
+			hit++;
+	} else {
+		c->flags &= ~MISH_CLIENT_SEARCH;
+		return 0;
+	}
+	// the ones that got trimmed are gone
+	if (s->hit[hit] < m->backlog.head)
+		return 1;
+	if (hit != c->search_hit) {
+		c->search_hit = hit;
+		_mish_client_goto(c, s->hit[hit]);
+	}
+	return 1;
+}
+
+int
+_mish_client_search_line(
+		mish_p m,
+		mish_client_p c,
+		uint64_t seq)
+{
+	if (!(c->flags & MISH_CLIENT_SEARCH) ||
+			c->search->hit[c->search_hit] != seq)
+		return 0;
+	const char * text;
+	mish_backlog_line_p l = _mish_backlog_get(&m->backlog, seq, &text);
+	const char * match = l ?
+			_mish_backlog_search_match(c->search, text, l->len) : NULL;
+	if (!match)
+		return 0;
+	_mish_send_queue_span(c, text, match - text);
+	_mish_send_queue(c, "\033[7m");
+	_mish_send_queue_span(c, match, c->search->len);
+	_mish_send_queue(c, "\033[27m");
+	match += c->search->len;
+	_mish_send_queue_span(c, match, l->len - (match - text));
+	return 1;
+}
+
+static void
+_mish_cmd_grep(
+		void * param,
+		int argc,
+		const char * argv[])
+{
+	mish_client_p c = param;
+	char pattern[256] = "";
+
+	// the pattern can have spaces, no need to quote it
+	for (int i = 1; i < argc; i++)
+		snprintf(pattern + strlen(pattern), sizeof(pattern) - strlen(pattern),
+				"%s%s", i > 1 ? " " : "", argv[i]);
+	_mish_client_search(c->mish, c, pattern);
+}
+
+MISH_CMD_NAMES(grep, "grep");
+MISH_CMD_HELP(grep,
+		"[pattern] Search the backlog for lines with 'pattern'.",
+		"'/pattern' at the prompt does the same. Then 'n' goes to the",
+		"previous match, 'N' to the next one. Without a pattern, the last",
+		"search is done again.");
+MISH_CMD_REGISTER_KIND(grep, _mish_cmd_grep, 0, MISH_CLIENT_CMD_KIND);
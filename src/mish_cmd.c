@@ -9,12 +9,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include "mish_priv_cmd.h"
 #include "mish_priv.h"
 #include "mish.h"
 
-#include "fifo_declare.h"
-
 
 #ifndef offsetof
 #define offsetof(type, member)  __builtin_offsetof (type, member)
@@ -37,16 +42,156 @@ typedef struct mish_cmd_t {
 } mish_cmd_t, *mish_cmd_p;
 
 typedef struct mish_cmd_call_t {
+	struct mish_cmd_call_t * next;
 	mish_cmd_p 		cmd;
 	char ** 		argv;
 	int				argc;
-} mish_cmd_call_t;
+} mish_cmd_call_t, *mish_cmd_call_p;
 
-DECLARE_FIFO(mish_cmd_call_t, mish_call_queue, 4);
-DEFINE_FIFO(mish_cmd_call_t, mish_call_queue);
+/*
+ * The command queues are intrusive multi-producer, single consumer lists
+ * (Vyukov's); any thread can queue a call with just an atomic exchange, and
+ * only one thread pops them (the runner thread for queue 0, whoever calls
+ * mish_cmd_poll() for queue 1). There's a 'stub' call so the list is never
+ * empty, which makes it all work without any compare-and-swap loops.
+ * The notification fd becomes readable when calls are queued.
+ */
+typedef struct mish_cmd_queue_t {
+	mish_cmd_call_p	head;		// last queued, producers swap it
+	mish_cmd_call_p	tail;		// next to pop, only the consumer uses it
+	mish_cmd_call_t	stub;
+	unsigned int	count;		// calls pending
+	unsigned int	max;		// max calls pending (0 = unlimited)
+	unsigned int	peak;
+	unsigned int	dropped;	// because of 'max'
+	uint64_t		queued;		// total, for statistics
+	int				fd[2];		// notification, same fd for eventfd
+} mish_cmd_queue_t, *mish_cmd_queue_p;
+
+/*
+ * All the command names (and aliases) are also in a trie, so looking up
+ * a command doesn't need to compare it with all the names. Each node knows
+ * if there's only one command below it, which is what makes unambiguous
+ * prefixes work, and it's also what is needed for completion.
+ * Children are kept in an array sorted by character, it's pretty compact
+ * as most nodes only have the one.
+ */
+typedef struct mish_cmd_trie_t {
+	mish_cmd_p		cmd;		// command with that exact name, if any
+	mish_cmd_p		only;		// command(s) below this node...
+	uint8_t			shared : 1;	// ...unless there's more than one
+	uint8_t			ch;
+	unsigned int	count;		// number of children
+	struct mish_cmd_trie_t * child;
+} mish_cmd_trie_t, *mish_cmd_trie_p;
 
 static TAILQ_HEAD(,mish_cmd_t) _cmd_list = TAILQ_HEAD_INITIALIZER(_cmd_list);
-static mish_call_queue_t 	_cmd_fifo[2] = {0};
+static mish_cmd_trie_t		_cmd_trie = {0};
+static mish_cmd_queue_t 	_cmd_queue[2] = {
+	[0 ... 1] = { .max = MISH_CMD_QUEUE_MAX, .fd = { -1, -1 } },
+};
+
+static mish_cmd_trie_p
+_mish_cmd_trie_child(
+		mish_cmd_trie_p n,
+		uint8_t ch,
+		int create)
+{
+	unsigned int lo = 0, hi = n->count;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (n->child[mid].ch == ch)
+			return &n->child[mid];
+		if (n->child[mid].ch < ch)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!create)
+		return NULL;
+	n->child = realloc(n->child, (n->count + 1) * sizeof(*n->child));
+	memmove(&n->child[lo + 1], &n->child[lo],
+			(n->count - lo) * sizeof(*n->child));
+	n->count++;
+	n->child[lo] = (mish_cmd_trie_t) { .ch = ch };
+	return &n->child[lo];
+}
+
+static void
+_mish_cmd_trie_add(
+		const char * name,
+		mish_cmd_p cmd)
+{
+	mish_cmd_trie_p n = &_cmd_trie;
+	for (const char * p = name; ; p++) {
+		if (!n->only)
+			n->only = cmd;
+		else if (n->only != cmd)
+			n->shared = 1;
+		if (!*p)
+			break;
+		n = _mish_cmd_trie_child(n, *p, 1);
+	}
+	if (n->cmd && n->cmd != cmd)
+		fprintf(stderr, "mish: duplicate command name '%s'\n", name);
+	else
+		n->cmd = cmd;
+}
+
+// return the node for that name, NULL if no command starts with it
+static mish_cmd_trie_p
+_mish_cmd_trie_find(
+		const char * name,
+		int l)
+{
+	mish_cmd_trie_p n = &_cmd_trie;
+	for (int i = 0; i < l && n; i++)
+		n = _mish_cmd_trie_child(n, name[i], 0);
+	return n;
+}
+
+static void
+_mish_cmd_trie_print(
+		mish_cmd_trie_p n,
+		char * name,
+		int l)
+{
+	if (n->cmd)
+		printf(" %.*s", l, name);
+	for (unsigned int i = 0; i < n->count && l < 63; i++) {
+		name[l] = n->child[i].ch;
+		_mish_cmd_trie_print(&n->child[i], name, l + 1);
+	}
+}
+
+int
+_mish_cmd_complete(
+		const char * name,
+		int l,
+		char * out,
+		int size)
+{
+	mish_cmd_trie_p n = _mish_cmd_trie_find(name, l);
+	if (!n || !n->only)
+		return 0;
+	int o = 0;
+	while (!n->cmd && n->count == 1 && o < size - 1) {
+		out[o++] = n->child[0].ch;
+		n = &n->child[0];
+	}
+	out[o] = 0;
+	// it stops short of a name when aliases of the one command part ways
+	if ((n->shared || !n->cmd) && !o) {
+		// nothing more to add, show what it could be
+		char buf[64];
+		int bl = l < 63 ? l : 63;
+		memcpy(buf, name, bl);
+		printf(MISH_COLOR_GREEN "mish:");
+		_mish_cmd_trie_print(n, buf, bl);
+		printf(MISH_COLOR_RESET "\n");
+	}
+	return n->cmd && !n->shared ? 1 : 2;
+}
 
 void __attribute__((weak))
 mish_register_cmd_kind(
@@ -70,6 +215,8 @@ mish_register_cmd_kind(
 	cmd->kind = kind;
 	cmd->flags = flags;
 
+	for (int i = 0; cmd_names[i]; i++)
+		_mish_cmd_trie_add(cmd_names[i], cmd);
 	// keep the list roughtly sorted
 	mish_cmd_p c, s;
 	TAILQ_FOREACH_SAFE(c, &_cmd_list, self, s) {
@@ -106,6 +253,11 @@ first_word_length(
 	return d - cmd_line;
 }
 
+/*
+ * Find the command for the first word of cmd_line; it can be any of its
+ * names, or the start of one, as long as there is only one command it
+ * could be.
+ */
 mish_cmd_p
 mish_cmd_lookup(
 		const char * cmd_line)
@@ -113,13 +265,12 @@ mish_cmd_lookup(
 	if (!cmd_line)
 		return NULL;
 	int l = first_word_length(cmd_line);
-	mish_cmd_p cmd;
-	TAILQ_FOREACH(cmd, &_cmd_list, self) {
-		for (int i = 0; cmd->names && cmd->names[i]; i++)
-			if (!strncmp(cmd->names[i], cmd_line, l))
-				return cmd;
-	}
-	return NULL;
+	if (!l)
+		return NULL;
+	mish_cmd_trie_p n = _mish_cmd_trie_find(cmd_line, l);
+	if (!n)
+		return NULL;
+	return n->cmd ? n->cmd : n->shared ? NULL : n->only;
 }
 
 typedef struct _mish_argv_t {
@@ -212,6 +363,126 @@ mish_argv_free(
 	free((void*)r);
 }
 
+static void
+_mish_cmd_queue_push(
+		mish_cmd_queue_p q,
+		mish_cmd_call_p call)
+{
+	__atomic_store_n(&call->next, NULL, __ATOMIC_RELAXED);
+	mish_cmd_call_p prev = __atomic_exchange_n(&q->head, call,
+			__ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, call, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns NULL if the queue is empty, *or* if a producer is half way
+ * through a push; it will notify the fd once done, so that call will be
+ * picked up next time around.
+ */
+static mish_cmd_call_p
+_mish_cmd_queue_pop(
+		mish_cmd_queue_p q)
+{
+	if (!q->tail)		// never used
+		return NULL;
+	mish_cmd_call_p tail = q->tail;
+	mish_cmd_call_p next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	// this was the last one, put the stub back behind it
+	_mish_cmd_queue_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static void
+_mish_cmd_notify(
+		mish_cmd_queue_p q)
+{
+	if (q->fd[1] == -1)
+		return;
+#ifdef __linux__
+	uint64_t one = 1;
+	if (write(q->fd[1], &one, sizeof(one)))
+		;
+#else
+	if (write(q->fd[1], "", 1))	// if the pipe is full, that's fine
+		;
+#endif
+}
+
+// empty the notification fd, before looking at the queue
+static void
+_mish_cmd_drain(
+		mish_cmd_queue_p q)
+{
+	if (q->fd[0] == -1)
+		return;
+	uint8_t buf[64];
+	while (read(q->fd[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+void
+_mish_cmd_init()
+{
+	for (int i = 0; i < 2; i++) {
+		mish_cmd_queue_p q = &_cmd_queue[i];
+		if (q->tail)
+			continue;
+		q->head = q->tail = &q->stub;
+#ifdef __linux__
+		q->fd[0] = q->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (q->fd[0] == -1)
+			perror("mish: eventfd");
+#else
+		if (pipe(q->fd) == -1) {
+			perror("mish: pipe");
+			q->fd[0] = q->fd[1] = -1;
+		}
+		for (int f = 0; f < 2 && q->fd[f] != -1; f++) {
+			fcntl(q->fd[f], F_SETFL, fcntl(q->fd[f], F_GETFL) | O_NONBLOCK);
+			fcntl(q->fd[f], F_SETFD, FD_CLOEXEC);
+		}
+#endif
+	}
+}
+
+void
+_mish_cmd_wake(
+		unsigned int queue)
+{
+	_mish_cmd_notify(&_cmd_queue[!!queue]);
+}
+
+void
+_mish_cmd_wait(
+		unsigned int queue)
+{
+	mish_cmd_queue_p q = &_cmd_queue[!!queue];
+	if (q->fd[0] == -1) {
+		sleep(1);
+		return;
+	}
+	struct pollfd pfd = { .fd = q->fd[0], .events = POLLIN };
+	while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+		;
+}
+
 int
 mish_cmd_call(
 		const char * cmd_line,
@@ -223,6 +494,15 @@ mish_cmd_call(
 	mish_cmd_p cmd = mish_cmd_lookup(cmd_line);
 	if (!cmd) {
 		int l = first_word_length(cmd_line);
+		mish_cmd_trie_p n = _mish_cmd_trie_find(cmd_line, l);
+		if (n && l < 64) {
+			char buf[64];
+			memcpy(buf, cmd_line, l);
+			printf(MISH_COLOR_RED "mish: '%.*s' is ambiguous:", l, cmd_line);
+			_mish_cmd_trie_print(n, buf, l);
+			printf(MISH_COLOR_RESET "\n");
+			return -1;
+		}
 		printf(MISH_COLOR_RED
 				"mish: '%.*s' not found. type 'help'."
 				MISH_COLOR_RESET "\n",
@@ -232,27 +512,45 @@ mish_cmd_call(
 	int ac = 0;
 	char ** av = mish_argv_make(cmd_line, &ac);
 
-	mish_call_queue_t 	*fifo = &_cmd_fifo[cmd->flags.safe];
+	mish_cmd_queue_p q = &_cmd_queue[cmd->flags.safe];
 
 	// these are special commands, their parameter is the client
 	if (cmd->kind == MISH_CLIENT_CMD_KIND) {
-		cmd->cmd_cb(c, ac, (const char**)av);
+		// like the ones from a trigger, they aren't typed in a client
+		if (!c)
+			printf(MISH_COLOR_RED "mish: '%s' needs a terminal"
+					MISH_COLOR_RESET "\n", av[0]);
+		else
+			cmd->cmd_cb(c, ac, (const char**)av);
 		mish_argv_free(av);
 		return 0;
 	}
 	// all other commands are queued
-	if (!mish_call_queue_isfull(fifo)) {
-		mish_cmd_call_t fe = {
-				.cmd = cmd,
-				.argv = av,
-				.argc = ac,
-		};
-		mish_call_queue_write(fifo, fe);
-	} else {
+	unsigned int max = __atomic_load_n(&q->max, __ATOMIC_RELAXED);
+	unsigned int count = __atomic_add_fetch(&q->count, 1, __ATOMIC_RELAXED);
+	// queues not initialised means mish_prepare() wasn't called
+	if (!__atomic_load_n(&q->head, __ATOMIC_RELAXED) ||
+			(max && count > max)) {
+		__atomic_sub_fetch(&q->count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+		mish_argv_free(av);
 		fprintf(stderr,
-			"mish: cmd FIFO%d full, make sure to call mish_cmd_poll()!\n",
+			"mish: cmd queue %d full, make sure to call mish_cmd_poll()!\n",
 			cmd->flags.safe);
+		return -1;
 	}
+	// approximate, it's just for statistics
+	if (count > __atomic_load_n(&q->peak, __ATOMIC_RELAXED))
+		__atomic_store_n(&q->peak, count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&q->queued, 1, __ATOMIC_RELAXED);
+	mish_cmd_call_p call = malloc(sizeof(*call));
+	*call = (mish_cmd_call_t) {
+			.cmd = cmd,
+			.argv = av,
+			.argc = ac,
+	};
+	_mish_cmd_queue_push(q, call);
+	_mish_cmd_notify(q);
 	return cmd->flags.safe == 0;	// we got a command to run?
 }
 
@@ -261,17 +559,51 @@ _mish_cmd_flush(
 		unsigned int queue)
 {
 	int res = 0;
-	mish_call_queue_t 	*fifo = &_cmd_fifo[!!queue];
-	while (!mish_call_queue_isempty(fifo)) {
-		mish_cmd_call_t c = mish_call_queue_read(fifo);
-		c.cmd->cmd_cb(
-				c.cmd->param_cb,
-				c.argc, (const char**)c.argv);
-		mish_argv_free(c.argv);
+	mish_cmd_queue_p q = &_cmd_queue[!!queue];
+	mish_cmd_call_p c;
+
+	_mish_cmd_drain(q);
+	while ((c = _mish_cmd_queue_pop(q)) != NULL) {
+		c->cmd->cmd_cb(
+				c->cmd->param_cb,
+				c->argc, (const char**)c->argv);
+		mish_argv_free(c->argv);
+		free(c);
+		__atomic_sub_fetch(&q->count, 1, __ATOMIC_RELEASE);
 		res++;
 	}
+	/*
+	 * Calls queued while we were running the others have notified the fd,
+	 * but we might have run them already; so the fd stays readable only if
+	 * there is still something pending, it's not readable for nothing.
+	 */
+	if (res) {
+		_mish_cmd_drain(q);
+		if (__atomic_load_n(&q->count, __ATOMIC_ACQUIRE))
+			_mish_cmd_notify(q);
+	}
 	return res;
+}
 
+void
+_mish_cmd_queue_status(
+		unsigned int queue,
+		_mish_cmd_queue_status_t * st)
+{
+	mish_cmd_queue_p q = &_cmd_queue[!!queue];
+	st->count = __atomic_load_n(&q->count, __ATOMIC_RELAXED);
+	st->max = __atomic_load_n(&q->max, __ATOMIC_RELAXED);
+	st->peak = __atomic_load_n(&q->peak, __ATOMIC_RELAXED);
+	st->dropped = __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+	st->queued = __atomic_load_n(&q->queued, __ATOMIC_RELAXED);
+}
+
+void
+_mish_cmd_queue_set_max(
+		unsigned int queue,
+		unsigned int max)
+{
+	__atomic_store_n(&_cmd_queue[!!queue].max, max, __ATOMIC_RELAXED);
 }
 
 int
@@ -280,11 +612,20 @@ mish_cmd_poll()
 	return _mish_cmd_flush(1);
 }
 
+int
+mish_cmd_poll_fd()
+{
+	// could be called before mish_prepare(), or without it (MISH_OFF)
+	_mish_cmd_init();
+	return _cmd_queue[1].fd[0];
+}
+
 static const char *_help[] = {
 	"A few of the typical EMACS keys work for editing commands.",
 	"like, ^A-^E, ^W, ^K - ^P,^N to navigate history and ^L to",
 	"redraw.",
 	"BEG/PGUP/DOWN/END to change the view of the backlog buffer.",
+	"TAB completes command names, which can also be abbreviated.",
 	0,
 };
 static void
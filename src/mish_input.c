@@ -31,9 +31,7 @@ _mish_input_init(
 //	fprintf(stderr, "%s %d\n", __func__, fd);
 	in->fd = fd;
 	in->line = NULL;
-	FD_SET(in->fd, &m->select.read);
-	if (in->fd >= m->select.max - 1)
-		m->select.max = in->fd +1;
+	_mish_capture_watch(m, in->fd, MISH_WATCH_READ, in);
 
 	int flags = fcntl(fd, F_GETFL, NULL);
 	if (flags == 1) {
@@ -58,82 +56,373 @@ _mish_input_clear(
 		free(in->line);
 	in->line = NULL;
 	if (in->fd != -1) {
-		FD_CLR(in->fd, &m->select.read);
-		FD_CLR(in->fd, &m->select.write);
+		_mish_capture_watch(m, in->fd, 0, NULL);
 		close(in->fd);
 		in->fd = -1;
 	}
 }
 
+// length of the 'erase line' sequence at 'p', if there's one
+static size_t
+_mish_input_erase(
+		const uint8_t * p,
+		size_t len)
+{
+	if (len < 3 || p[0] != 0x1b || p[1] != '[')
+		return 0;
+	if (p[2] == 'K')
+		return 3;
+	return len > 3 && (p[2] == '0' || p[2] == '2') && p[3] == 'K' ? 4 : 0;
+}
+
+static int
+_mish_input_plain(
+		const uint8_t * p,
+		size_t len)
+{
+	while (len--)
+		if (*p < ' ' || *p++ >= 0x7f)
+			return 0;
+	return 1;
+}
+
+/*
+ * Terminals go back to the start of the line on a \r, and what comes next
+ * is written over it; that's how progress bars are drawn. So we do the same
+ * here, and only keep what the line would look like. Shorter plain text
+ * only overwrites the start of the line, but with escape sequences we can't
+ * tell what's on screen, so then the new text replaces it; so does an
+ * 'erase line' at the start, or the end of it.
+ * The end of line, or a \r at the end, is left alone. Returns non-zero if
+ * anything was overwritten.
+ * A line that isn't finished yet keeps where the cursor is: if the last
+ * text only overwrote the start, it stays after a \r, past what is shown,
+ * so the rest of the line goes on from there once it's read.
+ */
+static int
+_mish_input_collapse(
+		uint8_t * line,
+		size_t * len)
+{
+	size_t end = *len;
+
+	if (end && line[end - 1] == '\n')
+		end--;
+	while (end && line[end - 1] == '\r')
+		end--;
+	uint8_t * p = memchr(line, '\r', end);
+	if (!p)
+		return 0;
+	size_t out = p - line, l = 0;
+	int plain = _mish_input_plain(line, out), under = 0;
+	while (p < line + end) {
+		uint8_t * t = p + 1;
+		p = memchr(t, '\r', line + end - t);
+		if (!p)
+			p = line + end;
+		l = p - t;
+		size_t erase = _mish_input_erase(t, l);
+		t += erase;
+		l -= erase;
+		size_t tail = l >= 3 && _mish_input_erase(t + l - 3, 3) ? 3 :
+					l >= 4 && _mish_input_erase(t + l - 4, 4) ? 4 : 0;
+		l -= tail;
+		int was = plain;
+		plain = _mish_input_plain(t, l);
+		memmove(line, t, l);
+		// otherwise the end of the old text is still there
+		under = !(erase || tail || l >= out || !was || !plain);
+		if (!under)
+			out = l;
+	}
+	// there's room, the raw text had both, and the \r between them
+	if (under && line[*len - 1] != '\n') {
+		memmove(line + out + 1 + l, line + end, *len - end);
+		line[out] = '\r';
+		memcpy(line + out + 1, line, l);
+		*len = out + 1 + l + *len - end;
+		return 1;
+	}
+	memmove(line + out, line + end, *len - end);
+	*len = out + *len - end;
+	return 1;
+}
+
+// how much of the unfinished line is shown, the rest is under the cursor
+static size_t
+_mish_input_shown(
+		mish_p m,
+		mish_input_p in,
+		size_t len)
+{
+	char * under = in->capture && m->input.cr ?
+						memchr(in->line->line, '\r', len) : NULL;
+	return under ? under - in->line->line : len;
+}
+
+/*
+ * Add a line to the backlog, or change the partial line we added before,
+ * if it's still there.
+ */
+static void
+_mish_input_publish(
+		mish_p m,
+		mish_input_p in,
+		const char * text,
+		size_t len,
+		uint16_t flags)
+{
+	if (in->partial) {
+		if (_mish_backlog_replace(&m->backlog, in->partial, text, len, flags)) {
+			_mish_filter_forget(m, in->partial);
+			return;
+		}
+		// then it stays as it was, and this one is a new line
+		mish_backlog_line_p l = _mish_backlog_get(&m->backlog, in->partial, NULL);
+		if (l)
+			l->flags &= ~MISH_LINE_PARTIAL;
+	}
+	// the repeated lines can't get their count once they aren't the last
+	_mish_input_repeat_end(m);
+	in->partial = _mish_backlog_add(&m->backlog, text, len, flags);
+}
+
+/*
+ * Show the line we're still waiting the end of, as it is now; it's changed
+ * in place from then on, and when it's done.
+ */
+static void
+_mish_input_partial(
+		mish_p m,
+		mish_input_p in,
+		uint64_t now)
+{
+	in->partial_ms = now;
+	in->pending_ms = 0;
+	// it's shown like a finished line, without the \r it's waiting on, or
+	// the text that is under the cursor, see _mish_input_collapse()
+	char * text = in->line->line;
+	size_t len = _mish_input_shown(m, in, in->line->len);
+	while (len && text[len - 1] == '\r')
+		len--;
+	if (!len)
+		return;
+	char save = text[len];
+	text[len] = '\n';
+	_mish_input_publish(m, in, text, len + 1,
+			MISH_LINE_PARTIAL | (in->err ? MISH_LINE_ERR : 0));
+	text[len] = save;
+}
+
+/*
+ * Called by the capture thread each time around. A partial line that waited
+ * 'flush_ms' for its end is shown as it is, so prompts and the like don't
+ * stay invisible; once it's shown, it's updated every 'update_ms' at most.
+ * Returns how many ms until that's due, so the capture engine doesn't sleep
+ * past it, or -1 if there's nothing waiting; the count of repeated lines is
+ * shown the same way.
+ */
 int
-_mish_input_read(
+_mish_input_flush(
+		mish_p m,
+		mish_input_p in,
+		uint64_t now)
+{
+	// so does the count of a line that is repeated
+	int due = _mish_input_repeat_flush(m, in, now);
+
+	if (!in->pending_ms || (!in->partial && !m->input.flush_ms))
+		return due;
+	unsigned int after = in->partial ? m->input.update_ms : m->input.flush_ms;
+	if (now - in->pending_ms < after) {
+		int ms = in->pending_ms + after - now;
+		return due >= 0 && due < ms ? due : ms;
+	}
+	_mish_input_partial(m, in, now);
+	return due;
+}
+
+/*
+ * Store the current line, the captured outputs go straight to the main
+ * backlog, the others (client commands) are kept in our own.
+ */
+static void
+_mish_input_split(
+		mish_p m,
+		mish_input_p in,
+		char * text,
+		size_t len)
+{
+	if (in->capture) {
+		if (in->partial || !_mish_input_repeat(m, in, text, len)) {
+			// it could have been shown already, this is what it ended up as
+			_mish_input_publish(m, in, text, len, in->err ? MISH_LINE_ERR : 0);
+			_mish_input_repeat_start(m, in, in->partial, text, len);
+		}
+		in->partial = in->pending_ms = 0;
+		if (m->triggers || __atomic_load_n(&m->metric.count, __ATOMIC_RELAXED))
+			_mish_trigger_line(m, text, len);
+	} else
+		_mish_line_add(&in->backlog, text, len);
+}
+
+/*
+ * This is the parser for the inputs without a process() callback, like
+ * the captured stdout/stderr; we just look for the end of lines, and pass
+ * them along from where they are, only the last partial line is moved back
+ * to the start of the buffer.
+ */
+static void
+_mish_input_process_lines(
 		mish_p m,
-		fd_set * fds,
 		mish_input_p in)
 {
-	if (!FD_ISSET(in->fd, fds))
+	uint8_t * line = (uint8_t*)in->line->line;
+	uint8_t * s = line;
+	uint8_t * e = line + in->line->len;
+	const uint8_t * nl;
+	// we already looked at what's before 'done'
+	const uint8_t * p = line + in->line->done;
+
+	int cr = in->capture && m->input.cr;
+
+	while ((nl = _mish_scan_nl(p, e)) != NULL) {
+		size_t len = nl + 1 - s;
+		if (cr)
+			_mish_input_collapse(s, &len);
+		_mish_input_split(m, in, (char*)s, len);
+		s = (uint8_t*)nl + 1;
+		p = s;
+	}
+	if (s != line && s < e)
+		memmove(line, s, e - s);
+	size_t len = e - s;
+	/*
+	 * Lines that are overwritten with \r are progress bars and the like, they
+	 * are shown right away, and every 'update_ms'. Others wait for their end
+	 * for a bit, see _mish_input_flush(). That's once per read, not per byte.
+	 */
+	if (in->capture && len) {
+		int collapsed = cr && _mish_input_collapse(line, &len);
+		uint64_t now = _mish_stamp_ms();
+		in->line->len = len;
+		if ((collapsed || in->partial) &&
+				now - in->partial_ms >= m->input.update_ms)
+			_mish_input_partial(m, in, now);
+		else if (!in->pending_ms)
+			in->pending_ms = now;
+	}
+	in->line->len = in->line->done = len;
+	line[in->line->len] = 0;
+}
+
+/*
+ * Pass the new data to the optional handler, otherwise split it in lines
+ * and store them into the backlog.
+ */
+static void
+_mish_input_process(
+		mish_p m,
+		mish_input_p in)
+{
+	if (in->process)
+		in->process(m, in);
+	else
+		_mish_input_process_lines(m, in);
+}
+
+/*
+ * Make room for 'count' more bytes in the input buffer. If the current
+ * line is already as long as it can be, and we have no handler that would
+ * consume it, we split it here, otherwise we'd never make any progress.
+ */
+static int
+_mish_input_reserve(
+		mish_p m,
+		mish_input_p in,
+		uint32_t count)
+{
+	if (!_mish_line_reserve(&in->line, count))
 		return 0;
+	D(printf("  reserve bailed us\n");)
+	if (in->process || !in->line->done)
+		return -1;
+	_mish_input_split(m, in, in->line->line,
+			_mish_input_shown(m, in, in->line->done));
+	in->line->len = in->line->done = 0;
+	return _mish_line_reserve(&in->line, count);
+}
+
+static void
+_mish_input_close(
+		mish_p m,
+		mish_input_p in)
+{
+	_mish_capture_watch(m, in->fd, 0, NULL);
+	close(in->fd);
+	in->fd = -1;
+	printf(MISH_COLOR_RED "mish: telnet: disconnected"
+			MISH_COLOR_RESET "\n");
+}
+
+/*
+ * This is called by the capture engine when in->fd is ready to be read
+ */
+int
+_mish_input_read(
+		mish_p m,
+		mish_input_p in)
+{
+	if (in->fd == -1)
+		return -1;
 	do {
-		if (_mish_line_reserve(&in->line, 80)) {
-			D(printf("  reserve bailed us\n");)
+		if (_mish_input_reserve(m, in, 80))
 			break;
-		}
 		ssize_t rd = read(in->fd,
 						in->line->line + in->line->len,
 						in->line->size - in->line->len - 1);
 		if (rd == -1 && (errno == EWOULDBLOCK || errno == EAGAIN))
 			break;
 		if (rd <= 0) {
-			close(in->fd);
-			FD_CLR(in->fd, &m->select.read);
-			FD_CLR(in->fd, &m->select.write);
-			in->fd = -1;
-			printf(MISH_COLOR_RED "mish: telnet: disconnected"
-					MISH_COLOR_RESET "\n");
+			_mish_input_close(m, in);
 			return -1;
 		}
 		in->line->len += rd;
+		_mish_input_process(m, in);
 	} while (1);
-	uint8_t * s = (uint8_t*) in->line->line + in->line->done;
-	uint8_t * d = s;
-	int added = in->line->len - in->line->done;
-	D(printf(" buffer added %d done %d len %d size %d\n", added,
-			(int)in->line->done, (int)in->line->len, (int)in->line->size);
-	if (in->line->done)
-		printf("    buffer: '%.*s'\n", in->line->done, in->line->line);)
-	/*
-	 * This loop re-parse the data, passes it to the optional handler,
-	 * and then store processed lines into the backlog. This is not super
-	 * optimal in the case there isn't a process_char() callback, so perhaps
-	 * I should make another less 'generic' input parser that doesn't copy
-	 * stuff around (in place, often).
-	 */
-	while (added) {
-		int r = MISH_IN_STORE;
-		if (in->process_char)
-			r = in->process_char(m, in, *s);
-		else
-			r = *s == '\n' ? MISH_IN_SPLIT : MISH_IN_STORE;
-
-		if (r == MISH_IN_STORE || r == MISH_IN_SPLIT) {
-			*d++ = *s;
-			in->line->done++;
-		}
-		if (r == MISH_IN_SPLIT) {
-			D(printf("  split size %d remains %d : '%.*s'\n", in->line->done,
-					(int)added, in->line->done-1, in->line->line);)
-			_mish_line_add(&in->backlog, in->line->line, in->line->done);
-			d = (uint8_t*)in->line->line;
-			in->line->len = in->line->done = 0;
-		}
-		s++; added--;
-	}
-	*d = 0; // NUL terminate for debug purpose!
-	D(printf(" exit added %d done %d len %d size %d\n", added,
-			(int)in->line->done, (int)in->line->len, (int)in->line->size);
-	in->line->len = in->line->done;
-	if (in->line->done)
-		printf("    buffer: '%s'\n", in->line->line);)
 
 	return TAILQ_FIRST(&in->backlog) != NULL;
 }
+
+/*
+ * This is for capture engines that do their own reading (io_uring), the
+ * data they got is added to the input buffer, and processed as if it had
+ * been read() here. A zero length means the descriptor was closed.
+ */
+int
+_mish_input_append(
+		mish_p m,
+		mish_input_p in,
+		const void * buf,
+		size_t len)
+{
+	if (in->fd == -1)
+		return -1;
+	if (!len) {
+		_mish_input_close(m, in);
+		return -1;
+	}
+	const uint8_t * b = buf;
+	while (len) {
+		if (_mish_input_reserve(m, in, len > 4096 ? 4096 : len))
+			break;
+		size_t l = in->line->size - in->line->len - 1;
+		if (l > len)
+			l = len;
+		memcpy(in->line->line + in->line->len, b, l);
+		in->line->len += l;
+		b += l; len -= l;
+		_mish_input_process(m, in);
+	}
+	return TAILQ_FIRST(&in->backlog) != NULL;
+}
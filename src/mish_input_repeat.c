@@ -0,0 +1,171 @@
+/*
+ * mish_input_repeat.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "mish_priv.h"
+
+// room for the ' (repeated N times)'
+#define MISH_REPEAT_COUNT_SIZE	32
+
+/*
+ * When a captured line is the same as the one before it, it isn't added
+ * again; the one we have gets a ' (repeated N times)' added instead. The
+ * count is exact, but the line is only rewritten every 'update_ms', and
+ * once more when something else comes along. In 'fuzzy' mode, the numbers
+ * in the lines don't count, so lines with a counter or a timestamp are the
+ * same too; the first one is kept.
+ * Triggers and metrics still see every line, so their counts don't change.
+ */
+
+// length of the text, without its end of line
+static size_t
+_mish_repeat_text_len(
+		const char * text,
+		size_t len)
+{
+	while (len && (text[len - 1] == '\n' || text[len - 1] == '\r'))
+		len--;
+	return len;
+}
+
+static int
+_mish_repeat_same(
+		const uint8_t * a,
+		size_t al,
+		const uint8_t * b,
+		size_t bl,
+		int fuzzy)
+{
+	if (!fuzzy)
+		return al == bl && !memcmp(a, b, al);
+	size_t i = 0, j = 0;
+	while (i < al && j < bl) {
+		if (isdigit(a[i]) && isdigit(b[j])) {
+			while (i < al && isdigit(a[i]))
+				i++;
+			while (j < bl && isdigit(b[j]))
+				j++;
+			continue;
+		}
+		if (a[i++] != b[j++])
+			return 0;
+	}
+	return i == al && j == bl;
+}
+
+/*
+ * Rewrite the line with the current count; it can only grow if it's still
+ * the last line of the backlog, _mish_input_repeat_end() makes sure it is.
+ */
+static void
+_mish_repeat_show(
+		mish_p m,
+		mish_input_p in,
+		uint64_t now)
+{
+	const char * text;
+	mish_backlog_line_p l = _mish_backlog_get(&m->backlog, in->repeat.seq,
+									&text);
+
+	in->repeat.ms = now;
+	if (!l || in->repeat.shown == in->repeat.count)
+		return;
+	// it keeps the end of line it had
+	size_t eol = l->len - _mish_repeat_text_len(text, l->len);
+	char * line = malloc(l->len + MISH_REPEAT_COUNT_SIZE);
+	memcpy(line, text, in->repeat.len);
+	size_t len = in->repeat.len + sprintf(line + in->repeat.len,
+					" (repeated %u times)", in->repeat.count);
+	memcpy(line + len, text + l->len - eol, eol);
+	len += eol;
+	if (_mish_backlog_replace(&m->backlog, in->repeat.seq, line, len,
+				l->flags)) {
+		_mish_filter_forget(m, in->repeat.seq);
+		in->repeat.shown = in->repeat.count;
+	}
+	free(line);
+}
+
+int
+_mish_input_repeat(
+		mish_p m,
+		mish_input_p in,
+		const char * text,
+		size_t len)
+{
+	mish_backlog_line_p l;
+	const char * last;
+
+	if (!m->input.repeat || !in->repeat.seq ||
+			in->repeat.seq != _mish_backlog_last(&m->backlog) ||
+			!(l = _mish_backlog_get(&m->backlog, in->repeat.seq, &last)))
+		return 0;
+	if (!_mish_repeat_same((const uint8_t *)last, in->repeat.len,
+				(const uint8_t *)text, _mish_repeat_text_len(text, len),
+				m->input.repeat == MISH_INPUT_REPEAT_FUZZY))
+		return 0;
+	/*
+	 * The count has to fit in its segment, otherwise this one is added like
+	 * any other line, and starts its own run.
+	 */
+	size_t eol = l->len - _mish_repeat_text_len(last, l->len);
+	if (_mish_backlog_room(&m->backlog, in->repeat.seq) <
+			in->repeat.len + MISH_REPEAT_COUNT_SIZE + eol)
+		return 0;
+	in->repeat.count++;
+	uint64_t now = _mish_stamp_ms();
+	if (now - in->repeat.ms >= m->input.update_ms)
+		_mish_repeat_show(m, in, now);
+	return 1;
+}
+
+void
+_mish_input_repeat_start(
+		mish_p m,
+		mish_input_p in,
+		uint64_t seq,
+		const char * text,
+		size_t len)
+{
+	in->repeat.len = _mish_repeat_text_len(text, len);
+	// there has to be room for the count
+	in->repeat.seq = m->input.repeat && in->repeat.len +
+			MISH_REPEAT_COUNT_SIZE < MISH_MAX_LINE_SIZE ? seq : 0;
+	in->repeat.count = in->repeat.shown = 1;
+	in->repeat.ms = 0;
+}
+
+void
+_mish_input_repeat_end(
+		mish_p m)
+{
+	for (int i = 0; i < 2; i++) {
+		mish_input_p in = &m->origin[i];
+		if (!in->repeat.seq)
+			continue;
+		_mish_repeat_show(m, in, _mish_stamp_ms());
+		in->repeat.seq = 0;
+	}
+}
+
+int
+_mish_input_repeat_flush(
+		mish_p m,
+		mish_input_p in,
+		uint64_t now)
+{
+	if (!in->repeat.seq || in->repeat.shown == in->repeat.count)
+		return -1;
+	if (now - in->repeat.ms < m->input.update_ms)
+		return in->repeat.ms + m->input.update_ms - now;
+	_mish_repeat_show(m, in, now);
+	return -1;
+}
@@ -0,0 +1,171 @@
+/*
+ * mish_lz.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "mish_priv_backlog.h"
+
+/*
+ * This is a small LZ77 codec for the cold backlog segments, it's the same
+ * idea as LZ4 (and pretty much the same format): a sequence is a token byte
+ * with the number of literals in the high nibble, the match length (minus
+ * MISH_LZ_MIN_MATCH) in the low one, both extended with extra bytes when
+ * they are 15, then the literals, and a 16 bits match offset. The last
+ * sequence has only literals.
+ * Log output is very repetitive, so this is plenty good enough.
+ */
+#define MISH_LZ_HASH_BITS	12
+#define MISH_LZ_MIN_MATCH	4
+#define MISH_LZ_MAX_OFFSET	0xffff
+
+static inline uint32_t
+_mish_lz_read32(
+		const uint8_t * p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint8_t *
+_mish_lz_length(
+		uint8_t * op,
+		size_t l)
+{
+	while (l >= 255) {
+		*op++ = 255;
+		l -= 255;
+	}
+	*op++ = l;
+	return op;
+}
+
+/*
+ * Emit 'lit' literals from 'anchor', followed by a match (if match_len)
+ * Returns NULL if it doesn't fit in 'oend'.
+ */
+static uint8_t *
+_mish_lz_emit(
+		uint8_t * op,
+		uint8_t * oend,
+		const uint8_t * anchor,
+		size_t lit,
+		size_t offset,
+		size_t match_len)
+{
+	// worst case for the token, extended lengths and offset
+	if (op + 1 + (lit / 255) + 1 + lit + 2 + (match_len / 255) + 1 > oend)
+		return NULL;
+	size_t ml = match_len ? match_len - MISH_LZ_MIN_MATCH : 0;
+	uint8_t * token = op++;
+	*token = ((lit < 15 ? lit : 15) << 4) | (ml < 15 ? ml : 15);
+	if (lit >= 15)
+		op = _mish_lz_length(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+	if (!match_len)
+		return op;
+	*op++ = offset;
+	*op++ = offset >> 8;
+	if (ml >= 15)
+		op = _mish_lz_length(op, ml - 15);
+	return op;
+}
+
+size_t
+_mish_lz_compress(
+		const void * src,
+		size_t len,
+		void * dst,
+		size_t max)
+{
+	uint32_t hash[1 << MISH_LZ_HASH_BITS] = {};
+	const uint8_t * base = src;
+	const uint8_t * ip = base, * anchor = base;
+	const uint8_t * end = base + len;
+	// leave room at the end so the 4 bytes reads are always valid
+	const uint8_t * limit = len > 12 ? end - 12 : base;
+	uint8_t * op = dst, * oend = op + max;
+
+	while (ip < limit) {
+		uint32_t seq = _mish_lz_read32(ip);
+		uint32_t h = (seq * 2654435761u) >> (32 - MISH_LZ_HASH_BITS);
+		const uint8_t * ref = base + hash[h];
+		hash[h] = ip - base;
+		if (ref >= ip || ip - ref > MISH_LZ_MAX_OFFSET ||
+				_mish_lz_read32(ref) != seq) {
+			ip++;
+			continue;
+		}
+		size_t ml = MISH_LZ_MIN_MATCH;
+		while (ip + ml < end - 5 && ref[ml] == ip[ml])
+			ml++;
+		op = _mish_lz_emit(op, oend, anchor, ip - anchor, ip - ref, ml);
+		if (!op)
+			return 0;
+		ip += ml;
+		anchor = ip;
+	}
+	op = _mish_lz_emit(op, oend, anchor, end - anchor, 0, 0);
+	return op ? op - (uint8_t*)dst : 0;
+}
+
+static inline int
+_mish_lz_get_length(
+		const uint8_t ** ip,
+		const uint8_t * iend,
+		size_t * l)
+{
+	uint8_t b;
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*l += b;
+	} while (b == 255);
+	return 0;
+}
+
+ssize_t
+_mish_lz_decompress(
+		const void * src,
+		size_t len,
+		void * dst,
+		size_t max)
+{
+	const uint8_t * ip = src, * iend = ip + len;
+	uint8_t * op = dst, * oend = op + max;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t lit = token >> 4;
+		if (lit == 15 && _mish_lz_get_length(&ip, iend, &lit))
+			return -1;
+		if (lit > iend - ip || lit > oend - op)
+			return -1;
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip == iend)		// last sequence, no match
+			break;
+		if (iend - ip < 2)
+			return -1;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		size_t ml = token & 15;
+		if (ml == 15 && _mish_lz_get_length(&ip, iend, &ml))
+			return -1;
+		ml += MISH_LZ_MIN_MATCH;
+		if (!offset || offset > op - (uint8_t*)dst || ml > oend - op)
+			return -1;
+		// can overlap, so can't use memcpy
+		const uint8_t * ref = op - offset;
+		while (ml--)
+			*op++ = *ref++;
+	}
+	return op - (uint8_t*)dst;
+}
@@ -0,0 +1,315 @@
+/*
+ * mish_metric.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "mish_priv.h"
+#include "mish.h"
+
+/*
+ * Metrics count the lines that match a regex, keep the last number it
+ * captured, and how many lines per second match. The line is only given
+ * to the regex if it has the longest bit of plain text the regex needs;
+ * these are looked for by the trigger automaton, so there's just one pass
+ * over each line, however many metrics and triggers there are.
+ */
+
+static double
+_mish_metric_double(
+		uint64_t * v)
+{
+	uint64_t b = __atomic_load_n(v, __ATOMIC_RELAXED);
+	double d;
+	memcpy(&d, &b, sizeof(d));
+	return d;
+}
+
+static void
+_mish_metric_set_double(
+		uint64_t * v,
+		double d)
+{
+	uint64_t b;
+	memcpy(&b, &d, sizeof(b));
+	__atomic_store_n(v, b, __ATOMIC_RELAXED);
+}
+
+/*
+ * Longest run of plain characters that any line 'pattern' matches has to
+ * have. What is in () doesn't count, and if there's a | outside of them,
+ * there's nothing.
+ */
+static char *
+_mish_metric_text(
+		const char * pattern)
+{
+	const char * best = pattern, * run = NULL;
+	size_t best_len = 0;
+	int depth = 0;
+
+	for (const char * p = pattern; ; p++) {
+		int plain = *p && !depth && !strchr(".[]()*+?{}|^$\\", *p);
+		// a character that can repeat zero times isn't needed
+		if (plain && p[1] && strchr("*?{", p[1]))
+			plain = 0;
+		if (plain) {
+			if (!run)
+				run = p;
+			continue;
+		}
+		if (run && (size_t)(p - run) > best_len) {
+			best = run;
+			best_len = p - run;
+		}
+		run = NULL;
+		if (!*p)
+			break;
+		switch (*p) {
+			case '|':
+				if (!depth)
+					return strdup("");
+				break;
+			case '(': depth++; break;
+			case ')': depth--; break;
+			case '\\':
+				if (p[1])
+					p++;
+				break;
+			case '[':
+				p++;
+				if (*p == '^')
+					p++;
+				if (*p == ']')
+					p++;
+				while (*p && *p != ']')
+					p++;
+				if (!*p)
+					return strdup("");
+				break;
+			case '{':	// the counts aren't text
+				while (*p && *p != '}')
+					p++;
+				if (!*p)
+					return strdup("");
+				break;
+		}
+	}
+	return strndup(best, best_len);
+}
+
+/*
+ * What we print is captured too, so the metric names, and whatever else
+ * has the text of a metric in it, is split so it doesn't count.
+ */
+static void
+_mish_metric_printf(
+		mish_p m,
+		FILE * f,
+		const char * fmt,
+		...)
+{
+	unsigned int count = __atomic_load_n(&m->metric.count, __ATOMIC_ACQUIRE);
+	const char * text[MISH_METRIC_MAX];
+	char line[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	for (unsigned int i = 0; i < count; i++)
+		text[i] = m->metric.m[i].text;
+	_mish_trigger_print_split(f, line, text, count);
+}
+
+void
+_mish_metric_line(
+		mish_metric_p e,
+		const char * text,
+		size_t len)
+{
+	regmatch_t match[10];
+
+	if (!_mish_filter_regexec(&e->re, text, len,
+			e->group ? e->group + 1 : 0, match))
+		return;
+	// we're the only ones writing it
+	__atomic_store_n(&e->count, e->count + 1, __ATOMIC_RELAXED);
+	if (!e->group || match[e->group].rm_so == -1)
+		return;
+	char num[32];
+	int l = match[e->group].rm_eo - match[e->group].rm_so;
+	if (l >= (int)sizeof(num))
+		l = sizeof(num) - 1;
+	memcpy(num, text + match[e->group].rm_so, l);
+	num[l] = 0;
+	char * end;
+	double v = strtod(num, &end);
+	if (end != num)
+		_mish_metric_set_double(&e->value, v);
+}
+
+void
+_mish_metric_tick(
+		mish_p m)
+{
+	unsigned int count = __atomic_load_n(&m->metric.count, __ATOMIC_ACQUIRE);
+
+	if (!count)
+		return;
+	uint64_t now = _mish_stamp_ms();
+	for (unsigned int i = 0; i < count; i++) {
+		mish_metric_p e = &m->metric.m[i];
+		if (!e->tick_ms) {
+			e->tick_ms = now;
+			e->tick_count = e->count;
+			continue;
+		}
+		if (now - e->tick_ms < 1000)
+			continue;
+		_mish_metric_set_double(&e->rate,
+				(e->count - e->tick_count) * 1000.0 / (now - e->tick_ms));
+		e->tick_ms = now;
+		e->tick_count = e->count;
+	}
+}
+
+static mish_metric_p
+_mish_metric_find(
+		mish_p m,
+		const char * name)
+{
+	unsigned int count = __atomic_load_n(&m->metric.count, __ATOMIC_ACQUIRE);
+
+	for (unsigned int i = 0; i < count; i++)
+		if (!strcmp(m->metric.m[i].name, name))
+			return &m->metric.m[i];
+	return NULL;
+}
+
+int
+mish_metric_get(
+		struct mish_t * m,
+		const char * name,
+		unsigned long long * count,
+		double * value,
+		double * rate)
+{
+	mish_metric_p e = m ? _mish_metric_find(m, name) : NULL;
+
+	if (!e)
+		return -1;
+	if (count)
+		*count = __atomic_load_n(&e->count, __ATOMIC_RELAXED);
+	if (value)
+		*value = _mish_metric_double(&e->value);
+	if (rate)
+		*rate = _mish_metric_double(&e->rate);
+	return 0;
+}
+
+static void
+_mish_metric_add(
+		mish_p m,
+		const char * name,
+		const char * pattern,
+		int group)
+{
+	// only the runner thread adds them, so there's no race for the slot
+	unsigned int count = m->metric.count;
+	mish_metric_p e = &m->metric.m[count];
+
+	if (count == MISH_METRIC_MAX) {
+		fprintf(stderr, "mish: metric: no more than %d metrics\n",
+				MISH_METRIC_MAX);
+		return;
+	}
+	if (strlen(name) >= sizeof(e->name) || _mish_metric_find(m, name)) {
+		_mish_metric_printf(m, stderr,
+				"mish: metric: '%s' is too long, or used\n", name);
+		return;
+	}
+	if (group < 0 || group > 9) {
+		fprintf(stderr, "mish: metric: group %d, 1 to 9 only\n", group);
+		return;
+	}
+	memset(e, 0, sizeof(*e));
+	int err = regcomp(&e->re, pattern,
+					REG_EXTENDED | (group ? 0 : REG_NOSUB));
+	if (err) {
+		char msg[128];
+		regerror(err, &e->re, msg, sizeof(msg));
+		_mish_metric_printf(m, stderr, "mish: metric '%s': %s\n",
+				pattern, msg);
+		return;
+	}
+	if (group > (int)e->re.re_nsub) {
+		_mish_metric_printf(m, stderr, "mish: metric: '%s' has no group %d\n",
+				pattern, group);
+		regfree(&e->re);
+		return;
+	}
+	strcpy(e->name, name);
+	e->pattern = strdup(pattern);
+	e->text = _mish_metric_text(pattern);
+	e->group = group;
+	__atomic_store_n(&m->metric.count, count + 1, __ATOMIC_RELEASE);
+	_mish_metric_printf(m, stdout, "Metric %s added\n", name);
+}
+
+void
+_mish_metric_cmd(
+		mish_p m,
+		int argc,
+		const char * argv[])
+{
+	unsigned int count = __atomic_load_n(&m->metric.count, __ATOMIC_ACQUIRE);
+
+	if (argc >= 3 && !strcmp(argv[1], "add")) {
+		char * pattern = argc > 3 ?
+				_mish_trigger_unquote(argv[3]) : strdup(argv[2]);
+		_mish_metric_add(m, argv[2], pattern,
+				argc > 4 ? atoi(argv[4]) : 0);
+		free(pattern);
+		return;
+	}
+	if (argc == 2 && !strcmp(argv[1], "export")) {
+		for (unsigned int i = 0; i < count; i++) {
+			mish_metric_p e = &m->metric.m[i];
+			_mish_metric_printf(m, stdout, "%s_total %llu\n", e->name,
+					(unsigned long long)
+						__atomic_load_n(&e->count, __ATOMIC_RELAXED));
+			if (e->group)
+				_mish_metric_printf(m, stdout, "%s %g\n", e->name,
+						_mish_metric_double(&e->value));
+			_mish_metric_printf(m, stdout, "%s_rate %g\n", e->name,
+					_mish_metric_double(&e->rate));
+		}
+		return;
+	}
+	if (argc > 1) {
+		fprintf(stderr, "Unknown metric command '%s'\n", argv[1]);
+		return;
+	}
+	printf("Metrics: %u/%d\n", count, MISH_METRIC_MAX);
+	for (unsigned int i = 0; i < count; i++) {
+		mish_metric_p e = &m->metric.m[i];
+		_mish_metric_printf(m, stdout, "  %-16s %8llu lines %8.1f/s",
+				e->name, (unsigned long long)
+					__atomic_load_n(&e->count, __ATOMIC_RELAXED),
+				_mish_metric_double(&e->rate));
+		if (e->group)
+			printf(" last %g", _mish_metric_double(&e->value));
+		printf(" ");
+		// split the text it needs, not just the start of the regex
+		_mish_trigger_print_text(e->pattern,
+				strstr(e->pattern, e->text) - e->pattern);
+		printf("\n");
+	}
+}
@@ -10,24 +10,29 @@
 #define LIBMISH_SRC_MISH_PRIV_H_
 
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <termios.h>
+#include <regex.h>
 #include "bsd_queue.h"
 #include "mish_priv_vt.h"
 #include "mish_priv_line.h"
+#include "mish_priv_backlog.h"
 
 struct mish_t;
+typedef struct mish_trigger_set_t * mish_trigger_set_p;
 
 /*
- * The process_char callback of mish_input_t returns one of these.
+ * The io_uring capture engine needs a recent enough kernel header, it is
+ * also never picked by default, set MISH_CAPTURE=io_uring to use it.
  */
-enum {
-	MISH_IN_SKIP = 0, 	// skip current character (don't store)
-	MISH_IN_STORE, 		// store current character in input buffer
-	MISH_IN_SPLIT, 		// store current line, add it to backlog
-};
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define MISH_HAS_IO_URING 1
+#endif
+#endif
 
 #define MISH_CMD_KIND 			('m' << 24 | 'i' << 16 | 's' << 8 | 'h')
 #define MISH_CLIENT_CMD_KIND  	('c' << 24 | 'l' << 16 | 'i' << 8 | 'e')
@@ -39,16 +44,33 @@ enum {
 typedef struct mish_input_t {
 	// lines read from fd are queued in here when \n has been received
 	mish_line_queue_t	backlog;
-	uint32_t		is_telnet : 1, flush_on_nl : 1;
+	uint32_t		is_telnet : 1,
+					// lines go straight into the main mish backlog instead
+					capture : 1, err : 1;
 
-	// return 1 for the character to be stored, 0 for it to be skipped
-	int (*process_char)(
+	/*
+	 * Optional, gets everything that was read, in line->line up to
+	 * line->len; it can keep some of it for later (up to line->done)
+	 * Without it, the input is split into lines.
+	 */
+	int (*process)(
 			struct mish_t *m,
-			struct mish_input_t *i,
-			uint8_t ch);
+			struct mish_input_t *i);
 	void * 			refcon;	// reference constant, for the callbacks
 	int 			fd;
 	mish_line_p		line;
+	// backlog line showing the partial line, and when it was last updated
+	uint64_t		partial;
+	uint64_t		partial_ms;
+	// when the partial line changed, if that isn't shown yet (or 0)
+	uint64_t		pending_ms;
+	// the last line, to count it if it's repeated, see mish_input_repeat.c
+	struct {
+		uint64_t		seq;	// 0 if we're not counting
+		size_t			len;	// of its text, without the count
+		unsigned int	count, shown;
+		uint64_t		ms;		// when the count was last shown
+	}				repeat;
 } mish_input_t, *mish_input_p;
 
 /* various internal states for the client */
@@ -59,10 +81,63 @@ enum {
 	MISH_CLIENT_UPDATE_PROMPT 	= (1 << 3),
 	MISH_CLIENT_UPDATE_WINDOW 	= (1 << 4),
 	MISH_CLIENT_SCROLLING 		= (1 << 5),
-	MISH_CLIENT_HAS_CMD			= (1 << 6),
+	MISH_CLIENT_PASTE			= (1 << 6),	// in a bracketed paste
 	MISH_CLIENT_DELETE 			= (1 << 7),
+	// output fd has been added to the capture engine 'write' set
+	MISH_CLIENT_WANT_WRITE		= (1 << 8),
+	// the capture engine is doing a writev() for us (io_uring)
+	MISH_CLIENT_WRITING			= (1 << 9),
+	// 'search' is running, and going thru the hits with n/N
+	MISH_CLIENT_SEARCHING		= (1 << 10),
+	MISH_CLIENT_SEARCH			= (1 << 11),
+	// deleted, but the capture engine is still writing from its buffers
+	MISH_CLIENT_CLOSING			= (1 << 12),
 };
 
+/*
+ * Client filters, see mish_client_filter.c. Clients that ask for the same
+ * one share it, and it remembers what it said about each line.
+ */
+typedef struct mish_filter_t {
+	TAILQ_ENTRY(mish_filter_t) self;
+	unsigned int	refcount;
+	char *			spec;		// as it was typed, to share it
+	uint32_t		invert : 1,	// -v, show the lines that don't match
+					err : 1,	// only the stderr lines
+					has_re : 1;
+	regex_t			re;
+	// 2 bits per line from 'base'; it was looked at, and it is shown
+	uint64_t		base;
+	uint8_t *		cache;
+	size_t			size;		// in lines
+	// last run of hidden lines we went thru
+	struct {
+		uint64_t		from, to;
+	}				hidden;
+} mish_filter_t, *mish_filter_p;
+
+/*
+ * Metrics made from the output; the runner thread adds them ('mish metric
+ * add'), the capture thread updates them, and anyone can read them. They
+ * are never removed, so there are no locks; a new one is filled, then
+ * published by incrementing 'count'.
+ */
+#define MISH_METRIC_MAX		64
+
+typedef struct mish_metric_t {
+	char			name[32];
+	char *			pattern;	// regex
+	char *			text;		// that has to be in the line, can be ""
+	regex_t			re;
+	unsigned int	group;		// for the value, 0 = none
+	// these are atomic, value and rate are doubles
+	uint64_t		count;		// lines that matched
+	uint64_t		value;		// last number captured
+	uint64_t		rate;		// lines per second
+	// for the rate, capture thread only
+	uint64_t		tick_count, tick_ms;
+} mish_metric_t, *mish_metric_p;
+
 typedef struct mish_client_t {
 	TAILQ_ENTRY(mish_client_t) self;
 	struct mish_t *	mish;
@@ -78,9 +153,19 @@ typedef struct mish_client_t {
 	}				cr;
 	int				footer_height;	// # static lines at bottom of screen
 	int				current_vpos;
-	mish_line_p		bottom;
-	// Line we are currently sending (or NULL)
-	mish_line_p		sending;
+	uint64_t		bottom;		// backlog sequence numbers, 0 is 'none'
+	// Line we are currently sending (or 0)
+	uint64_t		sending;
+	// backlog 'replaced.gen' we last looked at
+	uint32_t		replaced;
+	/*
+	 * What the rows of the scrolling area show, 'row[1..h]' has a key made
+	 * from the line and the row in it, 0 is empty; see mish_client_screen.c
+	 */
+	struct {
+		uint64_t *		row;
+		int				h, w;
+	}				screen;
 
 	/*
 	 * Output sent to the client is made of bits we want to send to move
@@ -98,6 +183,8 @@ typedef struct mish_client_t {
 		// temporary sequence buffer, for composite output.
 		mish_line_p		sqb;
 		size_t			total;	// total bytes we sent
+		// oldest backlog line 'v' points into, so it isn't freed under us
+		uint64_t		pin;
 	}				output;
 
 	char			prompt[64];
@@ -132,6 +219,10 @@ typedef struct mish_client_t {
 		int w, h;	} window_size; // valid if MISH_CLIENT_HAS_WINDOW_SIZE
 	struct {
 		int x, y;	} cursor_pos; // valid if MISH_CLIENT_HAS_CURSOR_POS
+	// last backlog search, and the hit we're showing
+	mish_search_p	search;
+	unsigned int	search_hit;
+	mish_filter_p	filter;		// only show these lines, if not NULL
 } mish_client_t, *mish_client_p;
 
 // supplement the public ones from mish.h
@@ -143,6 +234,60 @@ enum {
 	MISH_CLEAR_BACKLOG	= (1 << 29),
 };
 
+/*
+ * What a capture engine can be asked to watch a file descriptor for.
+ */
+enum {
+	MISH_WATCH_READ		= (1 << 0),
+	MISH_WATCH_WRITE	= (1 << 1),
+};
+
+/*
+ * The capture thread waits for its file descriptors using one of these.
+ * select() is the portable one, and linux also gets an epoll() one; set
+ * MISH_CAPTURE=<name> in the environment to pick one explicitly.
+ *
+ * watch() is called whenever the interest for a descriptor changes; events
+ * is a combination of MISH_WATCH_*, zero means 'forget this one'. 'refcon'
+ * is the mish_input_p for inputs, &m->telnet for the listen socket, or NULL
+ * for client output descriptors.
+ * poll() waits for up to timeout_ms, reads any input that is ready, and
+ * returns the number of descriptors that were serviced, 0 on timeout.
+ * writev() is optional; if present, the engine does the client output
+ * itself, and calls _mish_send_written() once it's done.
+ */
+typedef struct mish_capture_engine_t {
+	const char *	name;
+	int			(*init)(
+					struct mish_t * m);
+	void		(*dispose)(
+					struct mish_t * m);
+	void		(*watch)(
+					struct mish_t * m,
+					int fd,
+					unsigned int events,
+					void * refcon);
+	int			(*poll)(
+					struct mish_t * m,
+					int timeout_ms);
+	int			(*writev)(
+					struct mish_t * m,
+					struct mish_client_t * c,
+					const struct iovec * io,
+					int ioc);
+} mish_capture_engine_t;
+
+// default for how often lines that are being overwritten are shown
+#define MISH_INPUT_UPDATE_MS	100
+// and how long a line waits for its end before it's shown anyway
+#define MISH_INPUT_FLUSH_MS		250
+// for m->input.repeat
+enum {
+	MISH_INPUT_REPEAT_OFF = 0,
+	MISH_INPUT_REPEAT_ON,		// the same lines are counted
+	MISH_INPUT_REPEAT_FUZZY,	// the numbers in them don't matter
+};
+
 typedef struct mish_t {
 	uint32_t		flags;
 	struct termios	orig_termios;	// original terminal settings
@@ -152,28 +297,59 @@ typedef struct mish_t {
 	uint64_t		stamp_start;
 
 	TAILQ_HEAD(, mish_client_t) clients;
+	TAILQ_HEAD(, mish_client_t) closing;	// see MISH_CLIENT_CLOSING
+	TAILQ_HEAD(, mish_filter_t) filters;	// the ones the clients use
 	mish_client_p	console;		// client that is also the original terminal.
 
 	pthread_t 		capture;		// libmish main thread
 	pthread_t 		cmd_runner;		// command runner thread
-	sem_t 			runner_block;	// semaphore to block the runner thread
 	pthread_t		main;			// todo: allow pause/stop/resume?
 
+	mish_backlog_t	backlog;
+	// how the captured output is made into lines, see mish_input.c
+	struct {
+		uint32_t		cr : 1;		// \r goes back to the start of the line
+		unsigned int	update_ms;	// how often partial lines are shown
+		unsigned int	flush_ms;	// how long they wait for their end first
+		unsigned int	repeat;		// MISH_INPUT_REPEAT_*
+	}				input;
+	// searches write to 'fd' when they are done, that wakes us up
+	struct {
+		mish_input_t	wake;
+		int				fd;
+	}				search;
+	// commands to run when the output matches, see mish_trigger.c
+	mish_trigger_set_p	triggers;
 	struct {
-		unsigned int 		max_lines;	// max lines in backlog (0 = unlimited)
-		mish_line_queue_t	log;
-		unsigned int		size;	// number of lines in backlog
-		size_t				alloc;	// number of bytes in the backlog
-	}				backlog;
+		mish_metric_t	m[MISH_METRIC_MAX];
+		unsigned int	count;		// atomic
+	}				metric;
 	struct {
 		int				listen;		// listen socket
 		int				port;		// port we're listening on
 	}				telnet;
-	// Used by the select thread in mish_capture_select.c
+	const mish_capture_engine_t * engine;
+	// Used by the select engine in mish_capture_select.c
 	struct {
 		fd_set			read, write;
 		int				max;
 	}				select;
+#ifdef MISH_HAS_IO_URING
+	// Used by the io_uring engine in mish_capture_uring.c
+	struct mish_uring_t *	uring;
+#endif
+#ifdef __linux__
+	// Used by the epoll engine in mish_capture_epoll.c
+	struct {
+		int				fd;
+		int				unpollable;	// # of entries in 'up'
+		struct {
+			int			fd;
+			unsigned int events;
+			void *		refcon;
+		}				up[8];	// regular files etc, always 'ready'
+	}				epoll;
+#endif
 } mish_t, *mish_p;
 
 mish_client_p
@@ -186,6 +362,10 @@ void
 mish_client_delete(
 		mish_p m,
 		mish_client_p c);
+// free a MISH_CLIENT_CLOSING client, once the engine is done with it
+void
+_mish_client_free(
+		mish_client_p c);
 
 /*
  * Sequence buffer handling
@@ -199,20 +379,233 @@ _mish_send_queue(
 		mish_client_p c,
 		const char * b);
 void
+_mish_send_queue_span(
+		mish_client_p c,
+		const char * b,
+		size_t l);
+void
 _mish_send_queue_fmt(
 		mish_client_p c,
 		const char *fmt, ...);
 void
 _mish_send_queue_line(
 		mish_client_p c,
-		mish_line_p line );
+		uint64_t seq );
+void
+_mish_send_written(
+		mish_client_p c,
+		ssize_t got);
+
+/*
+ * Backlog search for the clients, see mish_client_search.c
+ */
+void
+_mish_search_init(
+		mish_p m);
+// start searching for 'pattern', an empty one repeats the last search
+void
+_mish_client_search(
+		mish_p m,
+		mish_client_p c,
+		const char * pattern);
+// called by the client coroutines, once the search is done
+void
+_mish_client_search_done(
+		mish_p m,
+		mish_client_p c);
+// n/N keys, returns 1 if the key was used
+int
+_mish_client_search_key(
+		mish_p m,
+		mish_client_p c,
+		uint32_t glyph);
+// queue line 'seq' with the match highlighted, returns 0 if it's not a hit
+int
+_mish_client_search_line(
+		mish_p m,
+		mish_client_p c,
+		uint64_t seq);
+
+/*
+ * What the interactive clients show, see mish_client_screen.c
+ */
+// redraw the window, only sends the rows that changed
+void
+_mish_screen_update(
+		mish_p m,
+		mish_client_p c);
+// line 'seq' was sent at row 'vpos', it took 'rows'
+void
+_mish_screen_sent(
+		mish_p m,
+		mish_client_p c,
+		uint64_t seq,
+		int vpos,
+		int rows);
+// we don't know what's on screen anymore, the next update sends it all
+void
+_mish_screen_forget(
+		mish_client_p c);
+// line 'seq' was replaced, the rows that show it are out of date
+void
+_mish_screen_changed(
+		mish_client_p c,
+		uint64_t seq);
+// queue line 'seq', in color if needed
+void
+_mish_client_queue_line(
+		mish_p m,
+		mish_client_p c,
+		uint64_t seq);
+
+/*
+ * Client filters, see mish_client_filter.c
+ */
+// returns 1 if filter 'f' shows line 'seq'
+int
+_mish_filter_shows(
+		mish_p m,
+		mish_filter_p f,
+		uint64_t seq);
+// next/previous line filter 'f' shows, or 0
+uint64_t
+_mish_filter_next(
+		mish_p m,
+		mish_filter_p f,
+		uint64_t seq);
+uint64_t
+_mish_filter_prev(
+		mish_p m,
+		mish_filter_p f,
+		uint64_t seq);
+void
+_mish_filter_release(
+		mish_p m,
+		mish_filter_p f);
+// line 'seq' was changed, the filters have to look at it again
+void
+_mish_filter_forget(
+		mish_p m,
+		uint64_t seq);
+// regexec() on a backlog line, without its end of line
+int
+_mish_filter_regexec(
+		regex_t * re,
+		const char * text,
+		size_t len,
+		size_t nmatch,
+		regmatch_t * match);
+
+/*
+ * Triggers, see mish_trigger.c; the capture thread passes each captured
+ * line to _mish_trigger_line(), if there are any.
+ */
+void
+_mish_trigger_line(
+		mish_p m,
+		const char * text,
+		size_t len);
+// print 'text' so it doesn't match itself once it's captured; it's split
+// after the glyph at 'at'
+void
+_mish_trigger_print_text(
+		const char * text,
+		size_t at);
+// print 'line' to 'f', with each of the 'text' in it split the same way
+void
+_mish_trigger_print_split(
+		FILE * f,
+		const char * line,
+		const char * const * text,
+		unsigned int count);
+// the command arguments keep their quotes, this returns a copy without
+char *
+_mish_trigger_unquote(
+		const char * a);
+
+/*
+ * Metrics, see mish_metric.c
+ */
+void
+_mish_metric_line(
+		mish_metric_p e,
+		const char * text,
+		size_t len);
+// update the rates, the capture thread calls it every time around
+void
+_mish_metric_tick(
+		mish_p m);
+// 'mish metric ...', argv[0] is "metric"
+void
+_mish_metric_cmd(
+		mish_p m,
+		int argc,
+		const char * argv[]);
+
+// the lines as client 'c' sees them, with its filter
+static inline uint64_t
+_mish_client_next(
+		mish_p m,
+		mish_client_p c,
+		uint64_t seq)
+{
+	return c->filter ? _mish_filter_next(m, c->filter, seq) :
+				_mish_backlog_next(&m->backlog, seq);
+}
+
+static inline uint64_t
+_mish_client_prev(
+		mish_p m,
+		mish_client_p c,
+		uint64_t seq)
+{
+	return c->filter ? _mish_filter_prev(m, c->filter, seq) :
+				_mish_backlog_prev(&m->backlog, seq);
+}
 
-//! Parse current input buffer fro VT sequences, like keys.
+static inline uint64_t
+_mish_client_last(
+		mish_p m,
+		mish_client_p c)
+{
+	if (!c->filter || !_mish_backlog_last(&m->backlog))
+		return _mish_backlog_last(&m->backlog);
+	return _mish_filter_prev(m, c->filter, m->backlog.tail);
+}
+
+//! Parse current input buffer for VT sequences, like keys.
 int
 _mish_client_vt_parse_input(
 		struct mish_t *m,
-		struct mish_input_t *in,
-		uint8_t ich);
+		struct mish_input_t *in);
+
+// screen rows line 'seq' takes on client 'c', once wrapped
+static inline int
+_mish_client_line_rows(
+		mish_p m,
+		mish_client_p c,
+		uint64_t seq)
+{
+	mish_backlog_line_p l = _mish_backlog_get(&m->backlog, seq, NULL);
+	if (!l || !l->width || c->window_size.w < 1)
+		return 1;
+	return (l->width + c->window_size.w - 1) / c->window_size.w;
+}
+/*
+ * Return the line that is 'rows' screen rows after 'seq' (before it if
+ * negative), or 0 if the backlog ran out first.
+ */
+uint64_t
+_mish_client_walk_rows(
+		mish_p m,
+		mish_client_p c,
+		uint64_t seq,
+		int rows);
+// scroll an interactive client's display so line 'seq' is at the top
+void
+_mish_client_goto(
+		mish_client_p c,
+		uint64_t seq);
 
 /*
  * This is the main interactive client coroutine. This one is interesting.
@@ -238,8 +631,7 @@ mish_telnet_prepare(
 		uint16_t port);
 int
 mish_telnet_in_check(
-		mish_p m,
-		fd_set * r);
+		mish_p m);
 void
 mish_telnet_send_init(
 		mish_client_p c);
@@ -263,18 +655,146 @@ _mish_input_clear(
 int
 _mish_input_read(
 		mish_p m,
-		fd_set * fds,
 		mish_input_p in);
-// flush the command FIFO (queue = 0 for non-safe commands)
+int
+_mish_input_append(
+		mish_p m,
+		mish_input_p in,
+		const void * buf,
+		size_t len);
+// show the partial line if it waited long enough, returns ms until it's due
+int
+_mish_input_flush(
+		mish_p m,
+		mish_input_p in,
+		uint64_t now);
+
+/*
+ * Repeated lines, see mish_input_repeat.c
+ */
+// returns 1 if 'text' is the same as the last line, and was counted
+int
+_mish_input_repeat(
+		mish_p m,
+		mish_input_p in,
+		const char * text,
+		size_t len);
+// line 'seq' was just added, it's the one the next ones are compared to
+void
+_mish_input_repeat_start(
+		mish_p m,
+		mish_input_p in,
+		uint64_t seq,
+		const char * text,
+		size_t len);
+// a new line is about to be added, show the final counts
+void
+_mish_input_repeat_end(
+		mish_p m);
+// show the count if it's due, returns ms until it is, or -1
+int
+_mish_input_repeat_flush(
+		mish_p m,
+		mish_input_p in,
+		uint64_t now);
+
+/*
+ * Scanning for the end of lines in the captured output, see mish_scan.c
+ */
+typedef struct mish_scan_nl_t {
+	const char *	name;
+	const uint8_t *	(*scan)(
+						const uint8_t * s,
+						const uint8_t * e);
+} mish_scan_nl_t;
+// all the implementations we have, for benchmarks; terminated by a NULL name
+extern const mish_scan_nl_t _mish_scan_nl_impl[];
+// the one we use, the best the CPU can do
+extern const uint8_t * (*_mish_scan_nl)(
+		const uint8_t * s,
+		const uint8_t * e);
+// same thing for the substring search
+typedef struct mish_scan_find_t {
+	const char *	name;
+	const uint8_t *	(*find)(
+						const uint8_t * s,
+						const uint8_t * e,
+						const uint8_t * n,
+						size_t l);
+} mish_scan_find_t;
+extern const mish_scan_find_t _mish_scan_find_impl[];
+extern const uint8_t * (*_mish_scan_find)(
+		const uint8_t * s,
+		const uint8_t * e,
+		const uint8_t * n,
+		size_t l);
+
+/*
+ * Command queues; queue 0 is for the non-safe commands, run by the runner
+ * thread, queue 1 for the 'safe' ones, run by mish_cmd_poll()
+ */
+// default for the maximum number of pending calls in each queue
+#define MISH_CMD_QUEUE_MAX	1024
+
+typedef struct _mish_cmd_queue_status_t {
+	unsigned int	count, max, peak, dropped;
+	uint64_t		queued;
+} _mish_cmd_queue_status_t;
+
+// create the queues notification fds, can be called more than once
+void
+_mish_cmd_init();
+// run all the queued commands, returns how many were run
 int
 _mish_cmd_flush(
 		unsigned int queue);
+// wait until there is something in 'queue' (or _mish_cmd_wake() is called)
+void
+_mish_cmd_wait(
+		unsigned int queue);
+void
+_mish_cmd_wake(
+		unsigned int queue);
+void
+_mish_cmd_queue_status(
+		unsigned int queue,
+		_mish_cmd_queue_status_t * st);
+void
+_mish_cmd_queue_set_max(
+		unsigned int queue,
+		unsigned int max);
+
+/*
+ * Capture engines
+ */
+extern const mish_capture_engine_t _mish_capture_select;
+#ifdef __linux__
+extern const mish_capture_engine_t _mish_capture_epoll;
+#endif
+#ifdef MISH_HAS_IO_URING
+extern const mish_capture_engine_t _mish_capture_uring;
+#endif
+// pick (and init) the capture engine, honours MISH_CAPTURE env variable
+int
+_mish_capture_init(
+		mish_p m);
+
+static inline void
+_mish_capture_watch(
+		mish_p m,
+		int fd,
+		unsigned int events,
+		void * refcon)
+{
+	if (m->engine && fd != -1)
+		m->engine->watch(m, fd, events, refcon);
+}
 
 /*
  * Thread functions
  */
 void *
-_mish_capture_select(
+_mish_capture_thread(
 		void *param);
 void *
 _mish_cmd_runner_thread(
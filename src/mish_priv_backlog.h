@@ -0,0 +1,321 @@
+/*
+ * mish_priv_backlog.h
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef LIBMISH_SRC_MISH_PRIV_BACKLOG_H_
+#define LIBMISH_SRC_MISH_PRIV_BACKLOG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+/*
+ * The backlog is stored in 'segments'; the text of the lines is packed at the
+ * start of it, and a fixed size index telling where each line is grows down
+ * from the end; the segment is full when they meet.
+ *
+ * Lines are identified by a sequence number, which starts at 1 and only ever
+ * goes up, so 0 can be used as 'no line'. Getting rid of old lines is just
+ * a matter of moving 'head' forward, segments are freed once all their lines
+ * are behind it.
+ *
+ * Old segments are compressed ('cold'), and their data is freed; it is only
+ * decompressed again if someone wants to look at these lines, and a few of
+ * these are kept around in case they are wanted again.
+ */
+// needs to be larger than MISH_MAX_LINE_SIZE, so any line fits in a new one
+#define MISH_BACKLOG_SEGMENT_SIZE	(128 * 1024)
+// default number of lines kept uncompressed
+#define MISH_BACKLOG_COLD_LINES		100000
+// number of cold segments we keep decompressed
+#define MISH_BACKLOG_LOADED			4
+/*
+ * The optional search index is a bitmap of the trigrams (hashed) that are
+ * in each segment, so a search only looks at the segments that might have
+ * the pattern; 2^16 bits is 8KB for each 128KB segment.
+ */
+#define MISH_BACKLOG_GRAM_BITS		16
+#define MISH_BACKLOG_GRAM_SIZE		((1 << MISH_BACKLOG_GRAM_BITS) / 8)
+
+enum {
+	MISH_LINE_ERR		= (1 << 0),	// line was captured from stderr
+	// the line isn't finished, it is shown as it is now, and will change
+	MISH_LINE_PARTIAL	= (1 << 1),
+};
+
+typedef struct mish_backlog_line_t {
+	uint32_t		offset;		// in the segment 'text'
+	uint16_t		len;
+	uint16_t		flags;		// MISH_LINE_*
+	uint64_t		stamp : 48,	// from _mish_stamp_ms()
+					width : 16;	// columns on screen, without wrapping
+} mish_backlog_line_t, *mish_backlog_line_p;
+
+typedef union mish_segment_data_t {
+	char				text[MISH_BACKLOG_SEGMENT_SIZE];
+	mish_backlog_line_t	index[MISH_BACKLOG_SEGMENT_SIZE /
+								sizeof(mish_backlog_line_t)];
+} mish_segment_data_t, *mish_segment_data_p;
+
+typedef struct mish_segment_t {
+	uint64_t		first;		// sequence number of the first line
+	uint32_t		count;		// number of lines
+	uint32_t		used;		// bytes used in text[]
+	uint64_t		stamp;		// stamp of the last line
+	mish_segment_data_p data;	// NULL when cold, and not loaded
+	// compressed text, then index, if cold
+	uint8_t *		packed;
+	uint32_t		packed_size, packed_text;
+	uint32_t		touched;	// for the loaded cache
+	uint32_t		cold : 1;	// compression was tried already
+	uint8_t *		grams;		// search index, if any
+} mish_segment_t, *mish_segment_p;
+
+#define MISH_SEGMENT_INDEX_SIZE \
+	(MISH_BACKLOG_SEGMENT_SIZE / sizeof(mish_backlog_line_t))
+
+// index entry for the line 'i' of the segment, it has to be loaded
+static inline mish_backlog_line_p
+_mish_segment_line(
+		mish_segment_p s,
+		uint32_t i)
+{
+	return &s->data->index[MISH_SEGMENT_INDEX_SIZE - 1 - i];
+}
+
+typedef struct mish_backlog_t {
+	unsigned int 	max_lines;	// max lines in backlog (0 = unlimited)
+	size_t			max_bytes;	// max bytes for 'alloc' (0 = unlimited)
+	unsigned int	size;		// number of lines in backlog
+	size_t			alloc;		// number of bytes in the backlog
+	size_t			bytes;		// same, if it wasn't compressed
+	uint64_t		head;		// sequence of the first (oldest) line
+	uint64_t		tail;		// sequence the next line will get
+	mish_segment_p *seg;		// segments, oldest first
+	unsigned int	seg_count, seg_size;
+	mish_segment_data_p	spare;	// a free segment data, saves a malloc()
+	struct {
+		unsigned int	lines;	// compress segments this far back (0 = never)
+		unsigned int	age;	// or this old, in seconds (0 = never)
+		uint64_t		next;	// first line that wasn't looked at
+		unsigned int	loaded;	// cold segments currently decompressed
+		uint32_t		clock;	// for segment 'touched'
+		size_t			raw, packed;	// for the compression ratio
+	}				cold;
+	unsigned int	threads;	// for the searches (0 = one per CPU)
+	struct {
+		size_t			max;	// bytes for the index (0 = no index)
+		size_t			size;	// bytes used now
+		unsigned int	count;	// segments that have one
+	}				index;
+	// last line that was changed, 'gen' goes up each time, and was 'since'
+	// when that line started changing
+	struct {
+		uint64_t		seq;
+		uint32_t		gen, since;
+	}				replaced;
+} mish_backlog_t, *mish_backlog_p;
+
+void
+_mish_backlog_init(
+		mish_backlog_p b);
+void
+_mish_backlog_dispose(
+		mish_backlog_p b);
+// add a new line, returns its sequence number
+uint64_t
+_mish_backlog_add(
+		mish_backlog_p b,
+		const char * text,
+		size_t len,
+		uint16_t flags);
+/*
+ * Change the text of line 'seq', for the lines that are still being
+ * written to, like progress bars. Only the lines of the newest segment can
+ * change, and only the last one can grow; returns zero if it can't be done.
+ */
+int
+_mish_backlog_replace(
+		mish_backlog_p b,
+		uint64_t seq,
+		const char * text,
+		size_t len,
+		uint16_t flags);
+// how long line 'seq' can be made by _mish_backlog_replace(), 0 if it can't
+size_t
+_mish_backlog_room(
+		mish_backlog_p b,
+		uint64_t seq);
+// return line 'seq', and its text, or NULL if it's not in the backlog
+mish_backlog_line_p
+_mish_backlog_get(
+		mish_backlog_p b,
+		uint64_t seq,
+		const char ** text);
+/*
+ * Return the first line with a stamp at, or after 'stamp', or the last line
+ * if there are none; 0 if the backlog is empty.
+ */
+uint64_t
+_mish_backlog_find_stamp(
+		mish_backlog_p b,
+		uint64_t stamp);
+/*
+ * Forget the oldest lines until there are no more than 'max_lines' left
+ * (0 = unlimited), and until we are within 'max_bytes'; that one is done by
+ * whole segments, the newest one always stays. Also compress the segments
+ * that became cold, and drop the decompressed ones nobody looked at for a
+ * while.
+ * Segment data is only freed if it's before 'pin' (0 for none), as clients
+ * could still be writing from it.
+ */
+void
+_mish_backlog_trim(
+		mish_backlog_p b,
+		unsigned int max_lines,
+		uint64_t pin);
+
+/*
+ * Returns zero if segment 's' can't have 'pattern' in it, according to its
+ * search index; 1 if it might, or if it has no index.
+ */
+int
+_mish_backlog_index_match(
+		mish_segment_p s,
+		const char * pattern,
+		size_t len);
+
+/*
+ * Compression for the cold segments, both return the size of the output,
+ * zero (or -1) if it wouldn't fit in 'max'
+ */
+size_t
+_mish_lz_compress(
+		const void * src,
+		size_t len,
+		void * dst,
+		size_t max);
+ssize_t
+_mish_lz_decompress(
+		const void * src,
+		size_t len,
+		void * dst,
+		size_t max);
+
+/*
+ * Backlog search, see mish_backlog_search.c. The capture thread starts it,
+ * and the lines are looked at by another thread; the segments it looks at
+ * are copied at the start, and 'pin' has to be passed to
+ * _mish_backlog_trim() until it's done, so they aren't freed. The text of
+ * the newest one is copied too, as its lines can be replaced.
+ */
+#define MISH_SEARCH_MAX_HITS	(1024 * 1024)
+
+typedef struct mish_search_seg_t {
+	uint64_t		first;
+	uint32_t		count, used;
+	mish_segment_data_p data;	// NULL if it's cold, and not loaded
+	const uint8_t *	packed;
+	uint32_t		packed_size, packed_text;
+	// hits in this segment, they are merged once they are all done
+	uint64_t *		hit;
+	unsigned int	hit_count, hit_size;
+	unsigned int	cut : 1;	// not looked at, there were enough hits
+} mish_search_seg_t;
+
+typedef struct mish_search_t {
+	uint64_t		pin;		// first line looked at
+	char *			pattern;
+	size_t			len;
+	mish_search_seg_t * seg;
+	unsigned int	seg_count;
+	// the newest segment can still change, so it's looked at in a copy
+	mish_segment_data_p live;
+	unsigned int	skipped;	// segments the index ruled out
+	unsigned int	threads;	// that look at the segments
+	unsigned int	next;		// next segment to look at, atomic
+	unsigned int	total;		// hits of the segments done, atomic
+	uint64_t *		hit;		// sequence numbers of the matching lines
+	unsigned int	count, size;
+	unsigned int	truncated : 1;	// there were more than MAX_HITS
+	uint64_t		took_us;
+	int				done, cancel;	// only use them atomically
+	int				wake;		// something is written to it when done
+	pthread_t		thread;
+} mish_search_t, *mish_search_p;
+
+/*
+ * Start looking for 'pattern' in all the lines, hits are in line order.
+ * 'wake' is a file descriptor to write to when it's done, or -1.
+ */
+mish_search_p
+_mish_backlog_search(
+		mish_backlog_p b,
+		const char * pattern,
+		int wake);
+static inline int
+_mish_backlog_search_done(
+		mish_search_p s)
+{
+	return __atomic_load_n(&s->done, __ATOMIC_ACQUIRE);
+}
+// stops the search if it's still running
+void
+_mish_backlog_search_free(
+		mish_search_p s);
+// where the pattern is in 'text', or NULL
+const char *
+_mish_backlog_search_match(
+		mish_search_p s,
+		const char * text,
+		size_t len);
+
+// parse a size, with an optional K/M/G suffix
+size_t
+_mish_backlog_parse_size(
+		const char * s);
+
+// sequence of the last line, or 0 if the backlog is empty
+static inline uint64_t
+_mish_backlog_last(
+		mish_backlog_p b)
+{
+	return b->tail > b->head ? b->tail - 1 : 0;
+}
+
+static inline uint64_t
+_mish_backlog_next(
+		mish_backlog_p b,
+		uint64_t seq)
+{
+	return seq && seq + 1 < b->tail ? seq + 1 : 0;
+}
+
+static inline uint64_t
+_mish_backlog_prev(
+		mish_backlog_p b,
+		uint64_t seq)
+{
+	return seq > b->head ? seq - 1 : 0;
+}
+
+/*
+ * Lines can be trimmed from under a client, so it checks its positions
+ * when it uses them, and a line that is gone becomes the oldest we have.
+ */
+static inline uint64_t
+_mish_backlog_clamp(
+		mish_backlog_p b,
+		uint64_t seq)
+{
+	if (!seq || seq >= b->head)
+		return seq;
+	return b->tail > b->head ? b->head : 0;
+}
+
+#endif /* LIBMISH_SRC_MISH_PRIV_BACKLOG_H_ */
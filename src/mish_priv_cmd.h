@@ -32,6 +32,18 @@ int
 mish_cmd_call(
 		const char * cmd_line,
 		void * c);
+/*
+ * Complete the command name 'name' (of length 'l'), the rest of the name is
+ * copied into 'out'; returns 0 if no command starts with 'name', 1 if that
+ * makes it the whole name of the only one, 2 otherwise (the names are listed
+ * if it can't be extended).
+ */
+int
+_mish_cmd_complete(
+		const char * name,
+		int l,
+		char * out,
+		int size);
 
 
 #endif /* LIBMISH_SRC_MISH_PRIV_CMD_H_ */
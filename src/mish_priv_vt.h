@@ -31,7 +31,7 @@ typedef struct mish_vt_sequence_t {
 	union {
 		struct {
 			uint32_t	pc : 4,			// CSI; parameter count
-						seq_want : 4,	// how many more bytes we want (UTF8)
+						seq_want : 4,	// UTF8 decoder state
 						done : 1,		// sequence is done
 						error : 1;		// sequence was not valid
 		};
@@ -44,5 +44,31 @@ int
 _mish_vt_sequence_char(
 		mish_vt_sequence_p s,
 		uint8_t ch);
+// end of the run of printable ASCII that starts at 's'
+const uint8_t *
+_mish_vt_text_run(
+		const uint8_t * s,
+		const uint8_t * e);
+/*
+ * Decode 'len' bytes, and return how many glyphs they have; 's' keeps the
+ * state, so a sequence can be split between two calls.
+ */
+unsigned int
+_mish_vt_glyph_count(
+		mish_vt_sequence_p s,
+		const char * buf,
+		size_t len);
+// columns taken by glyph 'g', 0, 1, or 2 for the East Asian wide ones
+int
+_mish_vt_glyph_width(
+		uint32_t g);
+/*
+ * Number of columns 'buf' takes on a terminal; escape sequences and
+ * control characters don't count, and neither does the line wrapping.
+ */
+unsigned int
+_mish_vt_display_width(
+		const char * buf,
+		size_t len);
 
 #endif /* LIBMISH_SRC_MISH_PRIV_VT_H_ */
@@ -0,0 +1,204 @@
+/*
+ * mish_scan.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "mish_priv.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || \
+		(defined(__i386__) && defined(__SSE2__)))
+#define MISH_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Scanners for the end of line, for the captured output. They all return
+ * a pointer to the first '\n' between s and e, or NULL.
+ * The default one is picked the first time it's called, depending on what
+ * the CPU can do; the vector ones are only worth it as the lines we get
+ * are usually a few dozen bytes long.
+ */
+static const uint8_t *
+_mish_scan_nl_memchr(
+		const uint8_t * s,
+		const uint8_t * e)
+{
+	return memchr(s, '\n', e - s);
+}
+
+#ifdef MISH_SCAN_X86
+static const uint8_t *
+_mish_scan_nl_sse2(
+		const uint8_t * s,
+		const uint8_t * e)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	for (; e - s >= 16; s += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		if (mask)
+			return s + __builtin_ctz(mask);
+	}
+	for (; s < e; s++)
+		if (*s == '\n')
+			return s;
+	return NULL;
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *
+_mish_scan_nl_avx2(
+		const uint8_t * s,
+		const uint8_t * e)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	for (; e - s >= 32; s += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)s);
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		if (mask)
+			return s + __builtin_ctz(mask);
+	}
+	return _mish_scan_nl_sse2(s, e);
+}
+#endif
+
+const mish_scan_nl_t _mish_scan_nl_impl[] = {
+#ifdef MISH_SCAN_X86
+	{ .name = "avx2", .scan = _mish_scan_nl_avx2 },
+	{ .name = "sse2", .scan = _mish_scan_nl_sse2 },
+#endif
+	{ .name = "memchr", .scan = _mish_scan_nl_memchr },
+	{ 0 },
+};
+
+static const uint8_t *
+_mish_scan_nl_pick(
+		const uint8_t * s,
+		const uint8_t * e)
+{
+	_mish_scan_nl = _mish_scan_nl_memchr;
+#ifdef MISH_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		_mish_scan_nl = _mish_scan_nl_avx2;
+	else
+		_mish_scan_nl = _mish_scan_nl_sse2;
+#endif
+	return _mish_scan_nl(s, e);
+}
+
+const uint8_t * (*_mish_scan_nl)(
+		const uint8_t * s,
+		const uint8_t * e) = _mish_scan_nl_pick;
+
+/*
+ * Substring search, for the backlog search. These return the first
+ * occurrence of 'n' (of length 'l', at least one) between s and e, or NULL.
+ * The vector ones compare the first and the last byte of the needle at 16
+ * (or 32) positions at once, and only look at the rest of it where both
+ * match, which is rare.
+ */
+static const uint8_t *
+_mish_scan_find_memchr(
+		const uint8_t * s,
+		const uint8_t * e,
+		const uint8_t * n,
+		size_t l)
+{
+	while (e - s >= (ptrdiff_t)l) {
+		s = memchr(s, n[0], e - s - l + 1);
+		if (!s)
+			break;
+		if (!memcmp(s + 1, n + 1, l - 1))
+			return s;
+		s++;
+	}
+	return NULL;
+}
+
+#ifdef MISH_SCAN_X86
+static const uint8_t *
+_mish_scan_find_sse2(
+		const uint8_t * s,
+		const uint8_t * e,
+		const uint8_t * n,
+		size_t l)
+{
+	const __m128i first = _mm_set1_epi8(n[0]);
+	const __m128i last = _mm_set1_epi8(n[l - 1]);
+	for (; e - s >= (ptrdiff_t)(16 + l - 1); s += 16) {
+		__m128i f = _mm_loadu_si128((const __m128i *)s);
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + l - 1));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi8(f, first), _mm_cmpeq_epi8(b, last)));
+		for (; mask; mask &= mask - 1) {
+			int i = __builtin_ctz(mask);
+			if (l < 3 || !memcmp(s + i + 1, n + 1, l - 2))
+				return s + i;
+		}
+	}
+	return _mish_scan_find_memchr(s, e, n, l);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *
+_mish_scan_find_avx2(
+		const uint8_t * s,
+		const uint8_t * e,
+		const uint8_t * n,
+		size_t l)
+{
+	const __m256i first = _mm256_set1_epi8(n[0]);
+	const __m256i last = _mm256_set1_epi8(n[l - 1]);
+	for (; e - s >= (ptrdiff_t)(32 + l - 1); s += 32) {
+		__m256i f = _mm256_loadu_si256((const __m256i *)s);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + l - 1));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(
+				_mm256_cmpeq_epi8(f, first), _mm256_cmpeq_epi8(b, last)));
+		for (; mask; mask &= mask - 1) {
+			int i = __builtin_ctz(mask);
+			if (l < 3 || !memcmp(s + i + 1, n + 1, l - 2))
+				return s + i;
+		}
+	}
+	return _mish_scan_find_sse2(s, e, n, l);
+}
+#endif
+
+const mish_scan_find_t _mish_scan_find_impl[] = {
+#ifdef MISH_SCAN_X86
+	{ .name = "avx2", .find = _mish_scan_find_avx2 },
+	{ .name = "sse2", .find = _mish_scan_find_sse2 },
+#endif
+	{ .name = "memchr", .find = _mish_scan_find_memchr },
+	{ 0 },
+};
+
+static const uint8_t *
+_mish_scan_find_pick(
+		const uint8_t * s,
+		const uint8_t * e,
+		const uint8_t * n,
+		size_t l)
+{
+	_mish_scan_find = _mish_scan_find_memchr;
+#ifdef MISH_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		_mish_scan_find = _mish_scan_find_avx2;
+	else
+		_mish_scan_find = _mish_scan_find_sse2;
+#endif
+	return _mish_scan_find(s, e, n, l);
+}
+
+const uint8_t * (*_mish_scan_find)(
+		const uint8_t * s,
+		const uint8_t * e,
+		const uint8_t * n,
+		size_t l) = _mish_scan_find_pick;
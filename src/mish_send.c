@@ -36,6 +36,34 @@
  *
  *    Oh and we "lock" sqb to prevent any other things to be added.
  */
+/*
+ * Mark 'got' bytes of the output vectors as sent, return how many vectors
+ * are left to send.
+ */
+static int
+_mish_send_advance(
+		mish_client_p c,
+		ssize_t got)
+{
+	struct iovec * io = c->output.v;
+	int ioc = c->output.count;
+	while (ioc && io->iov_len == 0) {
+		io++; ioc--;
+	}
+	/* fill up vectors with what was written */
+	while (got > 0 && ioc) {
+		ssize_t b = got > io->iov_len ? io->iov_len : got;
+		io->iov_len -= b;
+		io->iov_base += b;
+		if (io->iov_len == 0) {
+			io++;
+			ioc--;
+		}
+		got -= b;
+	}
+	return ioc;
+}
+
 int
 _mish_send_flush(
 		mish_p m,
@@ -64,55 +92,84 @@ _mish_send_flush(
 	}
 	if (!c->output.count)
 		return 0;
+	/* engines that write for us will call _mish_send_written() when done */
+	if (c->flags & MISH_CLIENT_WRITING)
+		return 1;
 	/* if we don't have 'permission' to write yet, ask for it */
-	if (!FD_ISSET(c->output.fd, &m->select.write)) {
-		FD_SET(c->output.fd, &m->select.write);
+	if (!m->engine->writev && !(c->flags & MISH_CLIENT_WANT_WRITE)) {
+		c->flags |= MISH_CLIENT_WANT_WRITE;
+		_mish_capture_watch(m, c->output.fd, MISH_WATCH_WRITE, NULL);
 		return 1;
 	}
 	/* skip what we've already done */
 	struct iovec * io = c->output.v;
 	int ioc = c->output.count;
-	while (io->iov_len == 0 && ioc) {
+	while (ioc && io->iov_len == 0) {
 		io++; ioc--;
 	}
 	int res = 1;
 	if (ioc) {
+		if (m->engine->writev) {
+			if (m->engine->writev(m, c, io, ioc) == 0) {
+				c->flags |= MISH_CLIENT_WRITING;
+				return 1;
+			}
+			goto done;
+		}
 		ssize_t got = writev(c->output.fd, io, ioc);
 		if (got == -1) {
 			if (errno != EAGAIN && errno != EWOULDBLOCK) {
 				// we've been close down?
-				FD_CLR(c->output.fd, &m->select.write);
+				c->flags &= ~MISH_CLIENT_WANT_WRITE;
+				_mish_capture_watch(m, c->output.fd, 0, NULL);
 				goto done;
 			}
 		}
-		/* fill up vectors with what was written */
-		while (got > 0) {
-			ssize_t b = got > io->iov_len ? io->iov_len : got;
-			io->iov_len -= b;
-			io->iov_base += b;
-			if (io->iov_len == 0) {
-				io++;
-				ioc--;
-			}
-			got -= b;
-		}
+		ioc = _mish_send_advance(c, got);
 	}
 	if (ioc == 0) { // done!
 done:
 		res = 0;
 		c->output.count = 0;
+		c->output.pin = 0;
 		// also flush out temporary buffers, and unlock it
 		if (c->output.sqb) {
 			c->output.sqb->done = 0;
 			c->output.sqb->len = 0;
 		}
-		/* if nothing else is ready to send, clear us from the select loop */
-		if (!c->sending)
-			FD_CLR(c->output.fd, &m->select.write);
+		/* if nothing else is ready to send, clear us from the capture engine */
+		if (!c->sending && (c->flags & MISH_CLIENT_WANT_WRITE)) {
+			c->flags &= ~MISH_CLIENT_WANT_WRITE;
+			_mish_capture_watch(m, c->output.fd, 0, NULL);
+		}
 	}
 	return res;
 }
 
+/*
+ * This is called by the capture engines that do the writev() themselves
+ * (io_uring) once the vector they were given has been written. A negative
+ * 'got' means the descriptor is gone, so we just drop what's left; if the
+ * client was deleted in the meantime, it's freed now.
+ */
+void
+_mish_send_written(
+		mish_client_p c,
+		ssize_t got)
+{
+	c->flags &= ~MISH_CLIENT_WRITING;
+	if (c->flags & MISH_CLIENT_CLOSING) {
+		_mish_client_free(c);
+		return;
+	}
+	if (got < 0) {
+		for (int i = 0; i < c->output.count; i++)
+			c->output.v[i].iov_len = 0;
+		return;
+	}
+	_mish_send_advance(c, got);
+}
+
 /*
  * Add up a bit of output to something we want to send as a sequence
  */
@@ -158,10 +215,19 @@ _mish_send_queue(
 		mish_client_p c,
 		const char * b)
 {
-	int l = strlen(b);
+	_mish_send_queue_span(c, b, strlen(b));
+}
+
+void
+_mish_send_queue_span(
+		mish_client_p c,
+		const char * b,
+		size_t l)
+{
 	char *d = _mish_send_prep(c, l);
 
-	strcpy(d, b);
+	memcpy(d, b, l);
+	d[l] = 0;
 }
 
 /*
@@ -182,19 +248,29 @@ _mish_send_queue_fmt(
 	va_end(ap);
 }
 
+/*
+ * Queue a line from the main backlog; its text isn't copied, so remember
+ * we're using it, the capture thread won't free it until it's been sent.
+ */
 void
 _mish_send_queue_line(
 		mish_client_p c,
-		mish_line_p line )
+		uint64_t seq )
 {
+	const char * text;
+	mish_backlog_line_p l = _mish_backlog_get(&c->mish->backlog, seq, &text);
+	if (!l)
+		return;
 	/* allocate enough in the vector buffer */
 	if (c->output.count == c->output.size) {
 		c->output.size += 8;
 		c->output.v = realloc(c->output.v, c->output.size * sizeof(c->output.v[0]));
 	}
 	struct iovec *v = c->output.v + c->output.count;
-	v->iov_base = line->line;
-	v->iov_len = line->len;
+	v->iov_base = (void*)text;
+	v->iov_len = l->len;
 	c->output.count++;
-	c->output.total += line->len;
+	c->output.total += l->len;
+	if (!c->output.pin || seq < c->output.pin)
+		c->output.pin = seq;
 }
@@ -48,6 +48,17 @@ _mish_stamp_ms()
 	return res;
 }
 
+// 'off', 'on' or 'fuzzy', for the repeated lines
+static unsigned int
+_mish_input_repeat_mode(
+		const char * s)
+{
+	if (!strcmp(s, "fuzzy"))
+		return MISH_INPUT_REPEAT_FUZZY;
+	return !strcmp(s, "on") || !strcmp(s, "1") ?
+				MISH_INPUT_REPEAT_ON : MISH_INPUT_REPEAT_OFF;
+}
+
 /*
  * need to keep this around for atexit()
  */
@@ -77,10 +88,30 @@ mish_prepare(
 
 	mish_p m = (mish_p)calloc(1, sizeof(*m));
 
-	FD_ZERO(&m->select.read);
-	FD_ZERO(&m->select.write);
-	TAILQ_INIT(&m->backlog.log);
+	m->telnet.listen = -1;
+	if (_mish_capture_init(m)) {
+		fprintf(stderr, "mish: no capture engine available\n");
+		free(m);
+		return NULL;
+	}
+	_mish_backlog_init(&m->backlog);
+	if (getenv("MISH_BACKLOG_MAX_BYTES"))
+		m->backlog.max_bytes =
+				_mish_backlog_parse_size(getenv("MISH_BACKLOG_MAX_BYTES"));
+	if (getenv("MISH_BACKLOG_INDEX"))
+		m->backlog.index.max =
+				_mish_backlog_parse_size(getenv("MISH_BACKLOG_INDEX"));
+	if (getenv("MISH_SEARCH_THREADS"))
+		m->backlog.threads = atoi(getenv("MISH_SEARCH_THREADS"));
+	m->input.cr = !getenv("MISH_INPUT_CR") || atoi(getenv("MISH_INPUT_CR"));
+	m->input.update_ms = MISH_INPUT_UPDATE_MS;
+	m->input.flush_ms = getenv("MISH_INPUT_FLUSH_MS") ?
+			atoi(getenv("MISH_INPUT_FLUSH_MS")) : MISH_INPUT_FLUSH_MS;
+	if (getenv("MISH_INPUT_REPEAT"))
+		m->input.repeat = _mish_input_repeat_mode(getenv("MISH_INPUT_REPEAT"));
 	TAILQ_INIT(&m->clients);
+	TAILQ_INIT(&m->closing);
+	TAILQ_INIT(&m->filters);
 	m->flags = caps;
 	int tty = 0;
 	if (getenv("MISH_TTY")) {
@@ -136,24 +167,29 @@ mish_prepare(
 	m->stamp_start = _mish_stamp_ms();
 
 	_mish_input_init(m, &m->origin[0], io[0]);
+	m->origin[0].capture = 1;
 	if (dup2(io[1], 1) == -1) {
 		perror("dup2");
 		goto error;
 	}
 	if (!(caps & MISH_CAP_NO_STDERR)) {
 		_mish_input_init(m, &m->origin[1], ie[0]);
+		m->origin[1].capture = m->origin[1].err = 1;
 		if (dup2(ie[1], 2) == -1) {
 			perror("dup2");
 			goto error;
 		}
 	}
+	_mish_search_init(m);
 	mish_set_command_parameter(MISH_CMD_KIND, m);
 	atexit(_mish_atexit);
 //	m->main = pthread_self();
-	// TODO: Make an epoll polling thread for linux
-	sem_init(&m->runner_block, 0, 0);
+	_mish_cmd_init();
+	if (getenv("MISH_CMD_QUEUE_MAX"))
+		for (int i = 0; i < 2; i++)
+			_mish_cmd_queue_set_max(i, atoi(getenv("MISH_CMD_QUEUE_MAX")));
 	pthread_create(&m->cmd_runner, NULL, _mish_cmd_runner_thread, m);
-	pthread_create(&m->capture, NULL, _mish_capture_select, m);
+	pthread_create(&m->capture, NULL, _mish_capture_thread, m);
 
 	_mish = m;
 	return m;
@@ -166,6 +202,8 @@ error:
 		close(ie[0]);
 		close(ie[1]);
 	}
+	if (m->engine && m->engine->dispose)
+		m->engine->dispose(m);
 	free(m);
 	return NULL;
 }
@@ -202,9 +240,9 @@ mish_terminate(
 	pthread_t t1 = m->cmd_runner, t2 = m->capture;
 	m->flags |= MISH_QUIT;
 	if (t1)
-		sem_post(&m->runner_block);
+		_mish_cmd_wake(0);
 	if (t2) {
-		// this will wake the select() call from sleep
+		// this will wake the capture thread from sleep
 		if (write(1, "\n", 1))
 			;
 		time_t start = time(NULL);
@@ -214,6 +252,9 @@ mish_terminate(
 	}
 	printf("\033[4l\033[;r\033[999;1H"); fflush(stdout);
 	//printf("%s done\n", __func__);
+	if (m->engine && m->engine->dispose)
+		m->engine->dispose(m);
+	_mish_backlog_dispose(&m->backlog);
 	free(m);
 	_mish = NULL;
 }
@@ -255,6 +296,7 @@ _mish_cmd_mish(
 			m->backlog.size,
 			(int)m->backlog.alloc / 1024,
 			m->telnet.port);
+	printf("Capture: %s\n", m->engine->name);
 #if 0
 	printf("  read: ");
 	for (int i = 0; i < m->select.max; i++)
@@ -287,15 +329,103 @@ _mish_cmd_mish(
 			} else if (!strcmp(argv[2], "max") && argv[3] && isdigit(argv[3][0])) {
 				m->backlog.max_lines = atoi(argv[3]);
 				printf("Backlog max lines set to %d\n", m->backlog.max_lines);
+			} else if (!strcmp(argv[2], "maxbytes") && argv[3] &&
+					isdigit(argv[3][0])) {
+				m->backlog.max_bytes = _mish_backlog_parse_size(argv[3]);
+				printf("Backlog max size set to %dKB\n",
+						(int)(m->backlog.max_bytes / 1024));
+			} else if (!strcmp(argv[2], "cold") && argv[3] &&
+					isdigit(argv[3][0])) {
+				m->backlog.cold.lines = atoi(argv[3]);
+				printf("Backlog compressed after %d lines\n",
+						m->backlog.cold.lines);
+			} else if (!strcmp(argv[2], "coldage") && argv[3] &&
+					isdigit(argv[3][0])) {
+				m->backlog.cold.age = atoi(argv[3]);
+				printf("Backlog compressed after %d seconds\n",
+						m->backlog.cold.age);
+			} else if (!strcmp(argv[2], "index") && argv[3] &&
+					isdigit(argv[3][0])) {
+				m->backlog.index.max = _mish_backlog_parse_size(argv[3]);
+				printf("Backlog search index max set to %dKB\n",
+						(int)(m->backlog.index.max / 1024));
+			} else if (!strcmp(argv[2], "threads") && argv[3] &&
+					isdigit(argv[3][0])) {
+				m->backlog.threads = atoi(argv[3]);
+				printf("Backlog search threads set to %d\n",
+						m->backlog.threads);
 			} else if (isdigit(argv[2][0])) {
 				m->backlog.max_lines = atoi(argv[2]);
 				printf("Backlog max lines set to %d\n", m->backlog.max_lines);
 			} else
 				fprintf(stderr, "Unknown backlog command '%s'\n", argv[2]);
 		} else {
-			printf("Backlog: %6d/%6d lines (%5dKB)\n",
+			printf("Backlog: %6d/%6d lines (%5d/%5dKB)\n",
 					m->backlog.size, m->backlog.max_lines,
-					(int)m->backlog.alloc / 1024);
+					(int)(m->backlog.alloc / 1024),
+					(int)(m->backlog.max_bytes / 1024));
+			printf("  resident %dKB, logical %dKB\n",
+					(int)(m->backlog.alloc / 1024),
+					(int)(m->backlog.bytes / 1024));
+			if (m->backlog.cold.packed)
+				printf("  compressed %dKB to %dKB (%.1f:1), %d loaded\n",
+						(int)(m->backlog.cold.raw / 1024),
+						(int)(m->backlog.cold.packed / 1024),
+						(double)m->backlog.cold.raw / m->backlog.cold.packed,
+						m->backlog.cold.loaded);
+			if (m->backlog.index.max)
+				printf("  search index %dKB/%dKB, %d segments\n",
+						(int)(m->backlog.index.size / 1024),
+						(int)(m->backlog.index.max / 1024),
+						m->backlog.index.count);
+			if (m->backlog.threads)
+				printf("  searches use %d threads\n", m->backlog.threads);
+		}
+	}
+	if (argv[1] && !strcmp(argv[1], "input")) {
+		for (int i = 2; i + 1 < argc; i += 2) {
+			if (!strcmp(argv[i], "cr"))
+				m->input.cr = !strcmp(argv[i + 1], "on");
+			else if (!strcmp(argv[i], "update") && isdigit(argv[i + 1][0]))
+				m->input.update_ms = atoi(argv[i + 1]);
+			else if (!strcmp(argv[i], "flush") && isdigit(argv[i + 1][0]))
+				m->input.flush_ms = atoi(argv[i + 1]);
+			else if (!strcmp(argv[i], "repeat"))
+				m->input.repeat = _mish_input_repeat_mode(argv[i + 1]);
+			else
+				fprintf(stderr, "Unknown input command '%s'\n", argv[i]);
+		}
+		printf("Input: \\r %s, partial lines updated every %ums\n",
+				m->input.cr ? "overwrites the line" : "is kept",
+				m->input.update_ms);
+		if (m->input.flush_ms)
+			printf("  shown after waiting %ums for their end\n",
+					m->input.flush_ms);
+		else
+			printf("  only shown once they end, unless overwritten\n");
+		printf("  repeated lines are %s\n",
+				m->input.repeat == MISH_INPUT_REPEAT_FUZZY ?
+					"counted, whatever numbers they have" :
+				m->input.repeat ? "counted" : "kept");
+	}
+	if (argv[1] && !strcmp(argv[1], "metric"))
+		_mish_metric_cmd(m, argc - 1, argv + 1);
+	if (argv[1] && !strcmp(argv[1], "queue")) {
+		if (argv[2] && !strcmp(argv[2], "max") && argv[3] &&
+				isdigit(argv[3][0])) {
+			for (int i = 0; i < 2; i++)
+				_mish_cmd_queue_set_max(i, atoi(argv[3]));
+			printf("Command queues max set to %d\n", atoi(argv[3]));
+		} else if (argv[2])
+			fprintf(stderr, "Unknown queue command '%s'\n", argv[2]);
+		for (int i = 0; i < 2; i++) {
+			_mish_cmd_queue_status_t st;
+			_mish_cmd_queue_status(i, &st);
+			printf("Queue %d (%s): %u/%u pending, peak %u, "
+					"%llu queued, %u dropped\n",
+					i, i ? "safe" : "runner",
+					st.count, st.max, st.peak,
+					(unsigned long long)st.queued, st.dropped);
 		}
 	}
 }
@@ -303,9 +433,37 @@ _mish_cmd_mish(
 MISH_CMD_NAMES(mish, "mish");
 MISH_CMD_HELP(mish,
 		"[cmd...] Displays mish status.",
-		"backlog [clear] [max <n>] - show backlog status\n"
-		"   also set the maximum lines in the backlog\n"
-		"   (0 = unlimited)\n"
+		"backlog [clear] [max <n>] [maxbytes <n>[K|M|G]]\n"
+		"   show backlog status, also set the maximum lines\n"
+		"   or size of the backlog (0 = unlimited)\n"
+		"   MISH_BACKLOG_MAX_BYTES sets the size at startup\n"
+		"backlog [cold <lines>] [coldage <seconds>]\n"
+		"   compress the backlog after that many lines, or\n"
+		"   that old (0 = never)\n"
+		"backlog [index <n>[K|M|G]]\n"
+		"   memory for the search index (0 = none, the default)\n"
+		"   MISH_BACKLOG_INDEX sets it at startup\n"
+		"backlog [threads <n>]\n"
+		"   threads for the searches (0 = one per CPU, the default)\n"
+		"   MISH_SEARCH_THREADS sets it at startup\n"
+		"input [cr on|off] [update <ms>] [flush <ms>]\n"
+		"   with cr on (the default), \\r goes back to the start\n"
+		"   of the line, and only what it ends up as is kept;\n"
+		"   lines that are being overwritten are shown every\n"
+		"   'update' ms. MISH_INPUT_CR=0 turns it off at startup\n"
+		"   Lines without their end yet are shown after 'flush'\n"
+		"   ms (0 = never), MISH_INPUT_FLUSH_MS at startup\n"
+		"input [repeat off|on|fuzzy]\n"
+		"   keep one line with a count when the same one comes\n"
+		"   again; 'fuzzy' ignores the numbers in them.\n"
+		"   MISH_INPUT_REPEAT sets it at startup\n"
+		"metric [add <name> [<regex> [<group>]]] [export]\n"
+		"   count the lines that match 'regex' (default 'name'),\n"
+		"   and keep the number in () 'group'; export prints\n"
+		"   them as name_total, name and name_rate lines\n"
+		"queue [max <n>]\n"
+		"   show the command queues, set the maximum pending\n"
+		"   commands (0 = unlimited), MISH_CMD_QUEUE_MAX at startup\n"
 		"Show status and a few bits of internals.");
 MISH_CMD_REGISTER_KIND(mish, _mish_cmd_mish, 0, MISH_CMD_KIND);
 
@@ -60,8 +60,14 @@ _mish_telnet_parse(
 	 * To handle telnet sequences, we pause the VT decoder
 	 */
 	switch (c->vts.seq) {
+		default:
+			// a finished VT sequence means we're back to RAW
+			if (!c->vts.done)
+				break;
+			/* fallthru */
 		case MISH_VT_RAW:
 			if (ch == IAC) {
+				c->vts.done = 0;
 				c->vts.seq = MISH_VT_TELNET;
 				return 1;
 			}
@@ -147,7 +153,7 @@ extern const char *__progname;
  * not going to go thru all the bits regarding sockets here, you know it.
  *
  * We allocate a random port, and listen to it, then add it to the
- * main select() thread.
+ * capture thread.
  */
 int
 mish_telnet_prepare(
@@ -197,7 +203,7 @@ mish_telnet_prepare(
 			perror("mish_telnet_prepare listen");
 			goto error;
 		}
-		FD_SET(m->telnet.listen, &m->select.read);
+		_mish_capture_watch(m, m->telnet.listen, MISH_WATCH_READ, &m->telnet);
 		return 0;
 	}
 	fprintf(stderr, "mish: %s failed\n", __func__);
@@ -212,12 +218,8 @@ error:
  */
 int
 mish_telnet_in_check(
-		mish_p m,
-		fd_set * r)
+		mish_p m)
 {
-	if (!FD_ISSET(m->telnet.listen, r))
-		return 0;
-
 	struct sockaddr_in a = {};
 	socklen_t al = sizeof(a);
 	int tf = accept(m->telnet.listen, (struct sockaddr *) &a, &al);
@@ -227,7 +229,8 @@ mish_telnet_in_check(
 	}
 	/*
 	 * it is necessary to have TWO file descriptors here, otherwise
-	 * the FD_SET/FD_CLR logic could be confusing as using the same bits.
+	 * the capture engine 'watch' logic could be confusing as using the
+	 * same descriptor for read and write.
 	 * a dup() isn't terribly expensive and guarantees we don't have to
 	 * worry about it.
 	 */
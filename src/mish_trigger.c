@@ -0,0 +1,388 @@
+/*
+ * mish_trigger.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mish_priv.h"
+#include "mish_priv_cmd.h"
+#include "mish.h"
+
+/*
+ * Triggers run a command when a captured line has some text in it. All the
+ * texts are looked for at once by an Aho-Corasick automaton, so it doesn't
+ * matter how many there are, each line is looked at once; a trigger can
+ * also have a regex, that is only tried on the lines that have the text.
+ *
+ * They are only used by the capture thread; the 'trigger' command is a
+ * client one, so it runs there too. The metrics (see mish_metric.c) use the
+ * same automaton, their texts come after the triggers'.
+ */
+// default for the minimum time between two runs of the same trigger
+#define MISH_TRIGGER_EVERY_MS	1000
+
+typedef struct mish_trigger_t {
+	char *			text;
+	char *			cmd;
+	regex_t			re;
+	uint32_t		has_re : 1;
+	unsigned int	every_ms;	// rate limit
+	uint64_t		last_ms;	// last time it ran
+	uint64_t		hits, runs;
+} mish_trigger_t, *mish_trigger_p;
+
+/*
+ * The bytes that are in none of the texts are all in class 0, the others
+ * get a class each; so the transition table is 'states' x 'classes'.
+ */
+typedef struct mish_trigger_set_t {
+	mish_trigger_t *	t;
+	unsigned int		count;
+	unsigned int		metrics;	// how many were there at the last build
+	uint32_t			line;		// lines looked at
+	// for each text; the next one that is the same, or -1, and the last
+	// line it was seen in, so they count once per line
+	int *				same;
+	uint32_t *			seen;
+	// the metrics that have no text, their regex is tried on every line
+	unsigned int *		always;
+	unsigned int		always_count;
+	uint8_t				cls[256];
+	unsigned int		classes;
+	unsigned int		states;
+	uint32_t *			delta;
+	int *				out;		// first trigger that ends in that state
+	uint32_t *			dict;		// next state on the fail chain with one
+} mish_trigger_set_t;
+
+static const char *
+_mish_trigger_text(
+		mish_p m,
+		mish_trigger_set_p s,
+		unsigned int i)
+{
+	return i < s->count ? s->t[i].text : m->metric.m[i - s->count].text;
+}
+
+static void
+_mish_trigger_build(
+		mish_p m,
+		mish_trigger_set_p s)
+{
+	unsigned int max = 1, i, count = s->count + s->metrics;
+
+	free(s->delta);
+	free(s->out);
+	free(s->dict);
+	s->same = realloc(s->same, (count + 1) * sizeof(s->same[0]));
+	s->seen = realloc(s->seen, (count + 1) * sizeof(s->seen[0]));
+	s->always = realloc(s->always, (s->metrics + 1) * sizeof(s->always[0]));
+	s->always_count = 0;
+	memset(s->cls, 0, sizeof(s->cls));
+	s->classes = 1;
+	for (i = 0; i < count; i++) {
+		const uint8_t * p = (uint8_t*)_mish_trigger_text(m, s, i);
+		if (!*p)
+			s->always[s->always_count++] = i - s->count;
+		for (; *p; p++, max++)
+			if (!s->cls[*p])
+				s->cls[*p] = s->classes++;
+		s->same[i] = -1;
+		s->seen[i] = s->line;
+	}
+	unsigned int c = s->classes;
+	s->delta = calloc(max * c, sizeof(s->delta[0]));
+	s->out = malloc(max * sizeof(s->out[0]));
+	s->dict = calloc(max, sizeof(s->dict[0]));
+	uint32_t * fail = calloc(max, sizeof(fail[0]));
+	for (i = 0; i < max; i++)
+		s->out[i] = -1;
+	/* the trie first; nothing goes back to the root (0) yet, so 0 is 'none' */
+	s->states = 1;
+	for (i = 0; i < count; i++) {
+		const uint8_t * p = (uint8_t*)_mish_trigger_text(m, s, i);
+		uint32_t st = 0;
+		if (!*p)
+			continue;
+		for (; *p; p++) {
+			uint32_t * d = &s->delta[st * c + s->cls[*p]];
+			if (!*d)
+				*d = s->states++;
+			st = *d;
+		}
+		s->same[i] = s->out[st];
+		s->out[st] = i;
+	}
+	/*
+	 * Then breadth first, the missing transitions become the ones of the
+	 * fail state, which is always less deep, so it's already done.
+	 */
+	uint32_t * queue = malloc(s->states * sizeof(queue[0]));
+	unsigned int qh = 0, qt = 1;
+	queue[0] = 0;
+	while (qh < qt) {
+		uint32_t u = queue[qh++];
+		for (i = 0; i < c; i++) {
+			uint32_t * d = &s->delta[u * c + i];
+			if (*d) {
+				uint32_t v = *d, f = u ? s->delta[fail[u] * c + i] : 0;
+				fail[v] = f;
+				s->dict[v] = s->out[f] != -1 ? f : s->dict[f];
+				queue[qt++] = v;
+			} else
+				*d = u ? s->delta[fail[u] * c + i] : 0;
+		}
+	}
+	free(queue);
+	free(fail);
+}
+
+static void
+_mish_trigger_fire(
+		mish_trigger_p t,
+		const char * text,
+		size_t len)
+{
+	if (t->has_re && !_mish_filter_regexec(&t->re, text, len, 0, NULL))
+		return;
+	t->hits++;
+	uint64_t now = _mish_stamp_ms();
+	if (t->runs && now - t->last_ms < t->every_ms)
+		return;
+	t->last_ms = now;
+	t->runs++;
+	mish_cmd_call(t->cmd, NULL);
+}
+
+void
+_mish_trigger_line(
+		mish_p m,
+		const char * text,
+		size_t len)
+{
+	mish_trigger_set_p s = m->triggers;
+	unsigned int metrics = __atomic_load_n(&m->metric.count, __ATOMIC_ACQUIRE);
+
+	// metrics are added by the runner thread, they just get published
+	if (!s || s->metrics != metrics) {
+		if (!s)
+			s = m->triggers = calloc(1, sizeof(*s));
+		s->metrics = metrics;
+		_mish_trigger_build(m, s);
+	}
+	if (!s->count && !s->metrics)
+		return;
+	const uint8_t * p = (const uint8_t *)text, * e = p + len;
+	unsigned int c = s->classes;
+	uint32_t st = 0;
+
+	s->line++;
+	for (unsigned int i = 0; i < s->always_count; i++)
+		_mish_metric_line(&m->metric.m[s->always[i]], text, len);
+	while (p < e) {
+		st = s->delta[st * c + s->cls[*p++]];
+		if (s->out[st] == -1 && !s->dict[st])
+			continue;
+		for (uint32_t f = st; f; f = s->dict[f])
+			for (int i = s->out[f]; i != -1; i = s->same[i]) {
+				if (s->seen[i] == s->line)
+					continue;
+				s->seen[i] = s->line;
+				if (i < (int)s->count)
+					_mish_trigger_fire(&s->t[i], text, len);
+				else
+					_mish_metric_line(&m->metric.m[i - s->count], text, len);
+			}
+	}
+}
+
+static void
+_mish_trigger_free(
+		mish_trigger_p t)
+{
+	if (t->has_re)
+		regfree(&t->re);
+	free(t->text);
+	free(t->cmd);
+}
+
+char *
+_mish_trigger_unquote(
+		const char * a)
+{
+	size_t l = strlen(a);
+	if (l >= 2 && (a[0] == '"' || a[0] == '\'') && a[l - 1] == a[0])
+		return strndup(a + 1, l - 2);
+	return strdup(a);
+}
+
+/*
+ * The list goes thru the capture like anything else, so the texts are
+ * printed with an escape sequence after their first glyph; otherwise
+ * listing the triggers would fire them all.
+ */
+void
+_mish_trigger_print_text(
+		const char * text,
+		size_t at)
+{
+	int l = at + 1;
+	if (!text[at])
+		l = at;
+	while ((text[l] & 0xc0) == 0x80)
+		l++;
+	printf("'%.*s\033[1m%s\033[22m'", l, text, text + l);
+}
+
+void
+_mish_trigger_print_split(
+		FILE * f,
+		const char * line,
+		const char * const * text,
+		unsigned int count)
+{
+	const char * p = line, * last = line;
+
+	while (*p) {
+		size_t l = 1;
+		while ((p[l] & 0xc0) == 0x80)
+			l++;
+		for (unsigned int i = 0; i < count; i++)
+			if (*text[i] && !strncmp(p, text[i], strlen(text[i]))) {
+				fprintf(f, "%.*s\033[22m", (int)(p + l - last), last);
+				last = p + l;
+				break;
+			}
+		p += l;
+	}
+	fputs(last, f);
+}
+
+/*
+ * The commands can have the text of any trigger, or metric, in them; even
+ * their own.
+ */
+static void
+_mish_trigger_print_cmd(
+		mish_p m,
+		mish_trigger_set_p s,
+		const char * cmd)
+{
+	unsigned int metrics = __atomic_load_n(&m->metric.count, __ATOMIC_ACQUIRE);
+	const char * text[s->count + metrics + 1];
+	unsigned int count = 0;
+
+	for (unsigned int i = 0; i < s->count; i++)
+		text[count++] = s->t[i].text;
+	for (unsigned int i = 0; i < metrics; i++)
+		text[count++] = m->metric.m[i].text;
+	_mish_trigger_print_split(stdout, cmd, text, count);
+}
+
+static void
+_mish_cmd_trigger(
+		void * param,
+		int argc,
+		const char * argv[])
+{
+	mish_client_p c = param;
+	mish_p m = c->mish;
+	mish_trigger_set_p s = m->triggers;
+	mish_trigger_t t = { .every_ms = MISH_TRIGGER_EVERY_MS };
+	int i = 1;
+
+	if (argc == 1) {
+		if (!s || !s->count) {
+			printf(MISH_COLOR_GREEN "mish: no triggers" MISH_COLOR_RESET "\n");
+			return;
+		}
+		for (unsigned int ti = 0; ti < s->count; ti++) {
+			mish_trigger_p e = &s->t[ti];
+			printf("%3u: ", ti + 1);
+			_mish_trigger_print_text(e->text, 0);
+			printf("%s -> ", e->has_re ? " (regex)" : "");
+			_mish_trigger_print_cmd(m, s, e->cmd);
+			printf(", %llu hits, %llu runs, every %.1fs\n",
+					(unsigned long long)e->hits,
+					(unsigned long long)e->runs, e->every_ms / 1000.0);
+		}
+		return;
+	}
+	if (!strcmp(argv[1], "-d") && argc == 3) {
+		unsigned int n = atoi(argv[2]);
+		if (!s || !n || n > s->count) {
+			printf(MISH_COLOR_RED "mish: trigger: no trigger %s"
+					MISH_COLOR_RESET "\n", argv[2]);
+			return;
+		}
+		_mish_trigger_free(&s->t[n - 1]);
+		memmove(&s->t[n - 1], &s->t[n], (s->count - n) * sizeof(s->t[0]));
+		s->count--;
+		_mish_trigger_build(m, s);
+		printf(MISH_COLOR_GREEN "mish: trigger %u removed"
+				MISH_COLOR_RESET "\n", n);
+		return;
+	}
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		if (!strcmp(argv[i], "-e")) {
+			t.every_ms = atof(argv[i + 1]) * 1000;
+		} else if (!strcmp(argv[i], "-r") && !t.has_re) {
+			char * re = _mish_trigger_unquote(argv[i + 1]);
+			int err = regcomp(&t.re, re, REG_EXTENDED | REG_NOSUB);
+			if (err) {
+				char msg[128];
+				regerror(err, &t.re, msg, sizeof(msg));
+				printf(MISH_COLOR_RED "mish: trigger '%s': %s"
+						MISH_COLOR_RESET "\n", re, msg);
+				free(re);
+				return;
+			}
+			free(re);
+			t.has_re = 1;
+		} else
+			break;
+	}
+	if (i + 1 >= argc) {
+		printf(MISH_COLOR_RED "mish: trigger: needs a text and a command"
+				MISH_COLOR_RESET "\n");
+		_mish_trigger_free(&t);
+		return;
+	}
+	t.text = _mish_trigger_unquote(argv[i++]);
+	if (!*t.text) {
+		printf(MISH_COLOR_RED "mish: trigger: the text can't be empty"
+				MISH_COLOR_RESET "\n");
+		_mish_trigger_free(&t);
+		return;
+	}
+	// the rest is the command, as it was typed
+	char cmd[256] = "";
+	for (; i < argc; i++)
+		snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd),
+				"%s%s", *cmd ? " " : "", argv[i]);
+	t.cmd = strdup(cmd);
+	if (!s)
+		s = m->triggers = calloc(1, sizeof(*s));
+	s->t = realloc(s->t, (s->count + 1) * sizeof(s->t[0]));
+	s->t[s->count++] = t;
+	_mish_trigger_build(m, s);
+	printf(MISH_COLOR_GREEN "mish: trigger %u: ", s->count);
+	_mish_trigger_print_text(t.text, 0);
+	printf(" runs '");
+	_mish_trigger_print_cmd(m, s, t.cmd);
+	printf("'" MISH_COLOR_RESET "\n");
+}
+
+MISH_CMD_NAMES(trigger, "trigger");
+MISH_CMD_HELP(trigger,
+		"[-e <seconds>] [-r <regex>] <text> <command...>",
+		"Run 'command' when a line of output has 'text' in it, and matches",
+		"'regex' if there is one. A trigger runs at most once every second,",
+		"or every -e <seconds>. Without arguments, list the triggers and",
+		"how many times they fired. 'trigger -d <n>' removes trigger n.");
+MISH_CMD_REGISTER_KIND(trigger, _mish_cmd_trigger, 0, MISH_CLIENT_CMD_KIND);
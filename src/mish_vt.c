@@ -7,80 +7,138 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "mish_priv_vt.h"
 
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(_a) (sizeof(_a) / sizeof((_a)[0]))
 #endif
 
+/*
+ * UTF8 decoder, this is Bjoern Hoehrmann's DFA
+ * (http://bjoern.hoehrmann.de/utf-8/decoder/dfa/); the first 256 entries
+ * map bytes to a class, the rest is the transition table for each state
+ * and class. It rejects overlong sequences, surrogates and the like.
+ */
+#define MISH_UTF8_ACCEPT	0
+#define MISH_UTF8_REJECT	1
+
+static const uint8_t _mish_utf8d[] = {
+	// 00..7f
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	// 80..bf
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+	7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+	// c0..ff
+	8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+	10,3,3,3,3,3,3,3,3,3,3,3,3,4,3,3,11,6,6,6,5,8,8,8,8,8,8,8,8,8,8,8,
+	// states, 16 classes each
+	0,1,2,3,5,8,7,1,1,1,4,6,1,1,1,1,
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+	1,0,1,1,1,1,1,0,1,0,1,1,1,1,1,1,
+	1,2,1,1,1,1,1,2,1,2,1,1,1,1,1,1,
+	1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1,
+	1,2,1,1,1,1,1,1,1,2,1,1,1,1,1,1,
+	1,1,1,1,1,1,1,3,1,3,1,1,1,1,1,1,
+	1,3,1,1,1,1,1,3,1,3,1,1,1,1,1,1,
+	1,3,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+};
+
+/*
+ * What a byte does in a CSI sequence; anything that isn't a parameter
+ * ends it.
+ */
+enum {
+	MISH_CSI_FINAL = 0,
+	MISH_CSI_DIGIT,
+	MISH_CSI_SEMI,
+	MISH_CSI_QUESTION,
+};
+static const uint8_t _mish_vt_csi[256] = {
+	['0' ... '9'] = MISH_CSI_DIGIT,
+	[';'] = MISH_CSI_SEMI,
+	['?'] = MISH_CSI_QUESTION,
+};
+
 /*
  * Handle sequences of VT100 and UTF8 chars.
  *
  * Uses the sequence 's' as temporary buffer, and returns 1 when a complete
  * sequence OR a glyph has been decoded.
  */
-int
-_mish_vt_sequence_char(
+static inline int
+_mish_vt_decode(
 		mish_vt_sequence_p s,
 		uint8_t ch)
 {
-	// if previous sequence was done, reset it.
+	// by far the most common, a plain character after another one
+	if (ch >= ' ' && ch < 0x7f && s->done && !s->error) {
+		s->seq = s->glyph = ch;
+		return 1;
+	}
 	if (s->done)
-		s->flags = s->seq = s->glyph = s->pc = s->p[0] = 0;
+		s->flags = s->seq = s->glyph = 0;
 	switch (s->seq) {
-		case MISH_VT_RAW: {
-			switch (ch) {
-				case 0x1b:
-					s->seq = MISH_VT_ESC;
-					break;
-				default: {
-					if (ch & 0x80) { // UTF8 !??!
-						int mask = 0x40;
-						s->seq_want = 0;
-						while ((ch & mask) && s->seq_want < 5) {
-							s->seq_want++;
-							mask >>= 1;
-						}
-						// clear header bits (ought to be 2; 1 allows encoding of 0xffffff)
-						s->glyph = ch & (0xff >> (s->seq_want + 1));
-						s->seq = MISH_VT_UTF8;
-					} else {
-						s->seq = (s->seq << 8) | ch;
-						s->glyph = ch;	// technically it's a glyph
-						s->done = 1;
-					}
-				}
+		case MISH_VT_RAW:
+			if (ch == 0x1b) {
+				s->seq = MISH_VT_ESC;
+				break;
+			}
+			if (!(ch & 0x80)) {
+				s->seq = s->glyph = ch;	// technically it's a glyph
+				s->done = 1;
+				break;
 			}
+			s->seq = MISH_VT_UTF8;
+			s->seq_want = MISH_UTF8_ACCEPT;
+			/* fallthru */
+		case MISH_VT_UTF8: {
+			uint8_t type = _mish_utf8d[ch];
+			// seq_want is the DFA state here
+			s->glyph = s->seq_want != MISH_UTF8_ACCEPT ?
+						(s->glyph << 6) | (ch & 0x3f) :
+						(0xff >> type) & ch;
+			s->seq_want = _mish_utf8d[256 + (s->seq_want * 16) + type];
+			if (s->seq_want == MISH_UTF8_REJECT) {
+				s->seq_want = MISH_UTF8_ACCEPT;
+				s->glyph = 0xfffd;	// replacement character
+				s->done = s->error = 1;
+			} else if (s->seq_want == MISH_UTF8_ACCEPT)
+				s->done = 1;
 		}	break;
-		case MISH_VT_ESC: {
-			if (ch == '[')
+		case MISH_VT_ESC:
+			if (ch == '[') {
 				s->seq = MISH_VT_CSI;
-			else {
+				s->pc = 0;
+				s->p[0] = 0;
+			} else {
 				s->seq = (s->seq << 8) | ch;
 				s->done = 1;
 			}
-		}	break;
+			break;
 		case MISH_VT_CSIQ:
-		case MISH_VT_CSI: {
-			switch (ch) {
-				case '?': {
-					// note this would still accept somelike like CSI ? 00?; 1
-					if ((s->seq == MISH_VT_CSIQ) || s->pc) {
-						s->done = s->error = 1;
-					} else
-						s->seq = MISH_VT_CSIQ;
-				}	break;
-				case '0' ... '9':
+		case MISH_VT_CSI:
+			switch (_mish_vt_csi[ch]) {
+				case MISH_CSI_DIGIT:
 					s->p[s->pc] = (s->p[s->pc] * 10) + (ch - '0');
 					break;
-				case ';': {
-					if (s->pc < ARRAY_SIZE(s->p)) {
+				case MISH_CSI_SEMI:
+					if (s->pc + 1 < ARRAY_SIZE(s->p)) {
 						s->pc++;
 						s->p[s->pc] = 0;
-					} else {
+					} else
 						s->done = s->error = 1;
-					}
-				}	break;
+					break;
+				case MISH_CSI_QUESTION:
+					// note this would still accept somelike like CSI ? 00?; 1
+					if ((s->seq == MISH_VT_CSIQ) || s->pc)
+						s->done = s->error = 1;
+					else
+						s->seq = MISH_VT_CSIQ;
+					break;
 				default:
 					if (s->p[s->pc])
 						s->pc++;
@@ -88,12 +146,7 @@ _mish_vt_sequence_char(
 					s->done = 1;
 					break;
 			}
-		}	break;
-		case MISH_VT_UTF8: {
-			s->glyph = (s->glyph << 6) | (ch & 0x3f);
-			if (s->seq_want) s->seq_want--;
-			s->done = s->seq_want == 0;
-		}	break;
+			break;
 	}
 #ifdef MISH_VT_DEBUG
 	if (s->done)
@@ -103,3 +156,146 @@ _mish_vt_sequence_char(
 #endif
 	return s->done;
 }
+
+int
+_mish_vt_sequence_char(
+		mish_vt_sequence_p s,
+		uint8_t ch)
+{
+	return _mish_vt_decode(s, ch);
+}
+
+/*
+ * Returns the end of the run of printable ASCII characters starting at 's',
+ * this is looked at 8 bytes at a time; a word is all text if none of its
+ * bytes are controls, DEL, or have the high bit set.
+ */
+const uint8_t *
+_mish_vt_text_run(
+		const uint8_t * s,
+		const uint8_t * e)
+{
+	const uint64_t ones = 0x0101010101010101ull;
+	const uint64_t high = ones * 0x80;
+
+	while (e - s >= 8) {
+		uint64_t v;
+		memcpy(&v, s, sizeof(v));
+		uint64_t ctl = (v - (ones * ' ')) & ~v & high;
+		uint64_t del = v ^ (ones * 0x7f);
+		del = (del - ones) & ~del & high;
+		if ((v & high) | ctl | del)
+			break;
+		s += 8;
+	}
+	while (s < e && *s >= ' ' && *s < 0x7f)
+		s++;
+	return s;
+}
+
+/*
+ * Glyphs that aren't one column wide, sorted; the zero width ones are the
+ * combining marks, the others are the East Asian wide/fullwidth ranges.
+ */
+static const struct {
+	uint32_t	lo, hi;
+	uint8_t		width;
+} _mish_vt_width[] = {
+	{ 0x0300, 0x036f, 0 }, { 0x0483, 0x0489, 0 }, { 0x0591, 0x05bd, 0 },
+	{ 0x0610, 0x061a, 0 }, { 0x064b, 0x065f, 0 }, { 0x1100, 0x115f, 2 },
+	{ 0x200b, 0x200f, 0 }, { 0x20d0, 0x20ff, 0 }, { 0x231a, 0x231b, 2 },
+	{ 0x2329, 0x232a, 2 }, { 0x23e9, 0x23ec, 2 }, { 0x25fd, 0x25fe, 2 },
+	{ 0x2614, 0x2615, 2 }, { 0x2648, 0x2653, 2 }, { 0x26aa, 0x26ab, 2 },
+	{ 0x26bd, 0x26be, 2 }, { 0x26c4, 0x26c5, 2 }, { 0x2705, 0x2705, 2 },
+	{ 0x270a, 0x270b, 2 }, { 0x2728, 0x2728, 2 }, { 0x274c, 0x274c, 2 },
+	{ 0x2753, 0x2755, 2 }, { 0x2757, 0x2757, 2 }, { 0x2795, 0x2797, 2 },
+	{ 0x2b1b, 0x2b1c, 2 }, { 0x2b50, 0x2b50, 2 }, { 0x2b55, 0x2b55, 2 },
+	{ 0x2e80, 0x303e, 2 }, { 0x3041, 0x33ff, 2 },
+	{ 0x3400, 0x4dbf, 2 }, { 0x4e00, 0x9fff, 2 }, { 0xa000, 0xa4cf, 2 },
+	{ 0xa960, 0xa97f, 2 }, { 0xac00, 0xd7a3, 2 }, { 0xf900, 0xfaff, 2 },
+	{ 0xfe00, 0xfe0f, 0 }, { 0xfe10, 0xfe19, 2 }, { 0xfe20, 0xfe2f, 0 },
+	{ 0xfe30, 0xfe6f, 2 }, { 0xff00, 0xff60, 2 }, { 0xffe0, 0xffe6, 2 },
+	{ 0x1f300, 0x1f64f, 2 }, { 0x1f900, 0x1f9ff, 2 },
+	{ 0x20000, 0x2fffd, 2 }, { 0x30000, 0x3fffd, 2 },
+};
+
+int
+_mish_vt_glyph_width(
+		uint32_t g)
+{
+	if (g < 0x7f)
+		return g >= ' ';
+	if (g < 0xa0)
+		return 0;
+	int lo = 0, hi = ARRAY_SIZE(_mish_vt_width) - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (g < _mish_vt_width[mid].lo)
+			hi = mid - 1;
+		else if (g > _mish_vt_width[mid].hi)
+			lo = mid + 1;
+		else
+			return _mish_vt_width[mid].width;
+	}
+	return 1;
+}
+
+/*
+ * Walk the span, and returns either the number of glyphs, or the number of
+ * columns they take; tabs go to the next multiple of 8 then.
+ */
+static inline unsigned int
+_mish_vt_span(
+		mish_vt_sequence_p s,
+		const char * buf,
+		size_t len,
+		int width)
+{
+	const uint8_t * p = (const uint8_t *)buf, * e = p + len;
+	unsigned int count = 0;
+	// work on a copy, so the compiler knows 'buf' doesn't change it
+	mish_vt_sequence_t sq = *s;
+
+	while (p < e) {
+		// runs of text only count if we're not in the middle of a sequence
+		if (sq.done || sq.seq == MISH_VT_RAW) {
+			const uint8_t * r = _mish_vt_text_run(p, e);
+			if (r > p) {
+				count += r - p;
+				sq.seq = sq.glyph = r[-1];
+				sq.flags = 0;
+				sq.done = 1;
+				p = r;
+				continue;
+			}
+		}
+		if (!_mish_vt_decode(&sq, *p++) || !sq.glyph)
+			continue;
+		if (!width)
+			count++;
+		else if (sq.glyph == '\t')
+			count = (count + 8) & ~7;
+		else
+			count += _mish_vt_glyph_width(sq.glyph);
+	}
+	*s = sq;
+	return count;
+}
+
+unsigned int
+_mish_vt_glyph_count(
+		mish_vt_sequence_p s,
+		const char * buf,
+		size_t len)
+{
+	return _mish_vt_span(s, buf, len, 0);
+}
+
+unsigned int
+_mish_vt_display_width(
+		const char * buf,
+		size_t len)
+{
+	mish_vt_sequence_t sq = {};
+	return _mish_vt_span(&sq, buf, len, 1);
+}
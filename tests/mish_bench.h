@@ -0,0 +1,95 @@
+/*
+ * mish_bench.h
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef LIBMISH_TESTS_MISH_BENCH_H_
+#define LIBMISH_TESTS_MISH_BENCH_H_
+
+/*
+ * Bits shared by the benchmark programs. They all print their results as
+ * one line of key=value pairs per measurement, starting with bench=<name>,
+ * so it can be grepped and compared between runs.
+ */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline double
+bench_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+/*
+ * The benchmarks don't want the console client to get in the way, so
+ * stdin and stdout are swapped for /dev/null before mish_prepare() is
+ * called; the descriptor returned is the original stdout, for the results.
+ */
+static inline int
+bench_detach_console()
+{
+	int out = dup(1);
+	int null = open("/dev/null", O_RDWR);
+	dup2(null, 0);
+	dup2(null, 1);
+	close(null);
+	return out;
+}
+
+/*
+ * Connect to the mish telnet port, and make it believe we're a 80x24
+ * terminal, so we get the same output as a real one.
+ */
+static inline int
+bench_telnet_connect()
+{
+	const char * p = getenv("MISH_TELNET_PORT");
+	struct sockaddr_in a = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		.sin_port = htons(p ? atoi(p) : 0),
+	};
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(s, (struct sockaddr *)&a, sizeof(a)) == -1) {
+		perror("bench: connect");
+		exit(1);
+	}
+	char buf[4096];
+	int got = 0;
+	double start = bench_now();
+	// wait for the 'where is the cursor' query
+	while (bench_now() - start < 2) {
+		struct pollfd pfd = { .fd = s, .events = POLLIN };
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		ssize_t r = read(s, buf + got, sizeof(buf) - got - 1);
+		if (r <= 0)
+			break;
+		got += r;
+		buf[got] = 0;
+		if (strstr(buf, "\033[6n")) {
+			const char * pos = "\033[24;80R";
+			if (write(s, pos, strlen(pos)))
+				;
+			break;
+		}
+		if (got > sizeof(buf) / 2)
+			got = 0;
+	}
+	return s;
+}
+
+#endif /* LIBMISH_TESTS_MISH_BENCH_H_ */
@@ -0,0 +1,177 @@
+/*
+ * mish_bench_flood.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE	// for memmem
+#include <pthread.h>
+#include <stdint.h>
+#include "mish_bench.h"
+#include "mish_priv.h"
+#include "mish.h"
+
+/*
+ * Throughput benchmark; print a lot of lines on stdout (and optionally
+ * stderr), at a given rate, and see how long it takes for them all to land
+ * in the backlog, and how much CPU the capture thread used doing it.
+ * With -c, that many telnet clients are attached, and we also measure how
+ * long until they all received the last line.
+ */
+#define BENCH_END	"mish-bench-end"
+
+typedef struct bench_client_t {
+	pthread_t	thread;
+	int			socket;
+	size_t		bytes;
+	double		done;		// time the last line was seen
+} bench_client_t;
+
+static void *
+_bench_client_thread(
+		void * param)
+{
+	bench_client_t * c = param;
+	char buf[65536 + sizeof(BENCH_END)];
+	size_t keep = 0;
+
+	for (;;) {
+		ssize_t r = read(c->socket, buf + keep, sizeof(buf) - 1 - keep);
+		if (r <= 0)
+			break;
+		c->bytes += r;
+		buf[keep + r] = 0;
+		// the marker could be split between two reads
+		if (memmem(buf, keep + r, BENCH_END, strlen(BENCH_END))) {
+			c->done = bench_now();
+			break;
+		}
+		size_t total = keep + r;
+		keep = total < strlen(BENCH_END) ? total : strlen(BENCH_END) - 1;
+		memmove(buf, buf + total - keep, keep);
+	}
+	return NULL;
+}
+
+static double
+_bench_thread_cpu(
+		pthread_t t)
+{
+	clockid_t id;
+	struct timespec ts;
+	if (pthread_getcpuclockid(t, &id) || clock_gettime(id, &ts))
+		return 0;
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void
+_bench_usage(
+		const char * p)
+{
+	fprintf(stderr,
+		"%s: [-n lines] [-s line size] [-r lines/s] [-e n] [-c clients]\n"
+		"  -n : number of lines to print (default 1000000)\n"
+		"  -s : size of each line, including the newline (default 80)\n"
+		"  -r : lines per second, 0 for as fast as possible (default 0)\n"
+		"  -e : print one line in 'n' on stderr (default 0, never)\n"
+		"  -c : number of telnet clients to attach (default 0)\n", p);
+	exit(1);
+}
+
+int main(
+		int argc,
+		const char * argv[])
+{
+	int lines = 1000000, size = 80, rate = 0, err = 0, clients = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] != '-' || !argv[i][1] || argv[i][2] || i == argc - 1)
+			_bench_usage(argv[0]);
+		int v = atoi(argv[++i]);
+		switch (argv[i-1][1]) {
+			case 'n': lines = v; break;
+			case 's': size = v; break;
+			case 'r': rate = v; break;
+			case 'e': err = v; break;
+			case 'c': clients = v; break;
+			default: _bench_usage(argv[0]);
+		}
+	}
+	if (size < 16)
+		size = 16;
+	if (size > MISH_MAX_LINE_SIZE)
+		size = MISH_MAX_LINE_SIZE;
+	int out = bench_detach_console();
+	mish_p m = mish_prepare(0);
+	if (!m)
+		exit(1);
+	// let the console client notice it has no terminal, and go away
+	usleep(100000);
+
+	bench_client_t * cl = calloc(clients ? clients : 1, sizeof(*cl));
+	for (int i = 0; i < clients; i++) {
+		cl[i].socket = bench_telnet_connect();
+		pthread_create(&cl[i].thread, NULL, _bench_client_thread, &cl[i]);
+	}
+	if (clients)
+		usleep(200000);
+
+	char line[MISH_MAX_LINE_SIZE + 1];
+	memset(line, 'x', size);
+	line[size - 1] = '\n';
+	line[size] = 0;
+
+	uint64_t first = __atomic_load_n(&m->backlog.tail, __ATOMIC_ACQUIRE);
+	double cpu = _bench_thread_cpu(m->capture);
+	double start = bench_now();
+	for (int i = 0; i < lines; i++) {
+		int l = snprintf(line, 16, "%9d ", i);
+		line[l] = ' ';
+		if (err && (i % err) == 0)
+			fwrite(line, size, 1, stderr);
+		else
+			fwrite(line, size, 1, stdout);
+		if (rate && (i % 100) == 99) {
+			double late = start + ((double)(i + 1) / rate) - bench_now();
+			if (late > 0) {
+				fflush(stdout);
+				usleep(late * 1e6);
+			}
+		}
+	}
+	printf(BENCH_END "\n");
+	fflush(stdout);
+	// the backlog gets other lines (telnet messages etc) so it's a minimum
+	while (__atomic_load_n(&m->backlog.tail, __ATOMIC_ACQUIRE) - first <
+			(uint64_t)lines + 1 && bench_now() - start < 120)
+		usleep(1000);
+	double captured = bench_now();
+	cpu = _bench_thread_cpu(m->capture) - cpu;
+
+	double delivered = captured;
+	size_t bytes = 0;
+	for (int i = 0; i < clients; i++) {
+		// they might never see it all if they were left behind, so give up
+		while (!cl[i].done && bench_now() - captured < 30)
+			usleep(1000);
+		if (!cl[i].done)
+			cl[i].done = bench_now();
+		if (cl[i].done > delivered)
+			delivered = cl[i].done;
+		bytes += cl[i].bytes;
+	}
+	double t = captured - start;
+	dprintf(out, "bench=flood clients=%d lines=%d line_size=%d rate=%d "
+			"stderr_every=%d seconds=%.3f lines_per_s=%.0f bytes_per_s=%.0f "
+			"capture_cpu_s=%.3f capture_cpu_pct=%.1f",
+			clients, lines, size, rate, err, t, lines / t,
+			((double)lines * size) / t, cpu, cpu * 100 / t);
+	if (clients)
+		dprintf(out, " delivery_seconds=%.3f client_bytes=%zu",
+				delivered - start, bytes);
+	dprintf(out, "\n");
+	// skip mish's atexit() cleanup, the clients are still connected
+	_exit(0);
+}
@@ -0,0 +1,89 @@
+/*
+ * mish_bench_latency.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE	// for memmem
+#include "mish_bench.h"
+#include "mish.h"
+
+/*
+ * Latency benchmark; print a line, and time how long it takes for it to
+ * reach an attached telnet client. Lines are sent one at a time, so this is
+ * the best case, with an otherwise idle capture thread.
+ */
+static int
+_bench_cmp(
+		const void * a,
+		const void * b)
+{
+	double d = *(const double *)a - *(const double *)b;
+	return d < 0 ? -1 : d > 0 ? 1 : 0;
+}
+
+int main(
+		int argc,
+		const char * argv[])
+{
+	int samples = 10000;
+
+	if (argc == 3 && !strcmp(argv[1], "-n"))
+		samples = atoi(argv[2]);
+	else if (argc != 1) {
+		fprintf(stderr, "%s: [-n samples]\n", argv[0]);
+		exit(1);
+	}
+	if (samples < 1)
+		samples = 1;
+	int out = bench_detach_console();
+	if (!mish_prepare(0))
+		exit(1);
+	usleep(100000);
+	int s = bench_telnet_connect();
+	usleep(200000);
+
+	double * lat = calloc(samples, sizeof(*lat));
+	int got = 0, lost = 0;
+	char buf[8192];
+	for (int i = 0; i < samples; i++) {
+		char marker[32];
+		int ml = sprintf(marker, "mish-lat %d\r", i);
+		size_t keep = 0;
+
+		double start = bench_now();
+		printf("%.*s\n", ml - 1, marker);
+		fflush(stdout);
+		int found = 0;
+		while (!found && bench_now() - start < 1) {
+			struct pollfd pfd = { .fd = s, .events = POLLIN };
+			if (poll(&pfd, 1, 100) <= 0)
+				continue;
+			ssize_t r = read(s, buf + keep, sizeof(buf) - keep);
+			if (r <= 0)
+				break;
+			keep += r;
+			found = memmem(buf, keep, marker, ml) != NULL;
+			if (!found && keep > (size_t)ml) {
+				memmove(buf, buf + keep - ml, ml);
+				keep = ml;
+			}
+		}
+		if (found)
+			lat[got++] = (bench_now() - start) * 1e6;
+		else
+			lost++;
+	}
+	qsort(lat, got, sizeof(*lat), _bench_cmp);
+	double sum = 0;
+	for (int i = 0; i < got; i++)
+		sum += lat[i];
+	#define P(_p) (got ? lat[(int)((got - 1) * (_p))] : 0)
+	dprintf(out, "bench=latency samples=%d lost=%d avg_us=%.1f p50_us=%.1f "
+			"p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+			got, lost, got ? sum / got : 0,
+			P(0.5), P(0.99), P(0.999), got ? lat[got - 1] : 0);
+	_exit(0);
+}
@@ -46,6 +46,11 @@ static ssize_t _test_read(int fd, void *w, size_t count) {
 
 #include "mish_input.c"
 #include "mish_line.c"
+#include "mish_backlog.c"
+#include "mish_lz.c"
+#include "mish_scan.c"
+#include "mish_vt.c"
+#include "mish_input_repeat.c"
 
 #undef read
 
@@ -59,9 +64,89 @@ _mish_stamp_ms()
 	return 0;
 }
 
+/* the lines of this test aren't captured, nothing to trigger */
+void
+_mish_trigger_line(
+		mish_p m,
+		const char * text,
+		size_t len)
+{
+}
+
+/* no client filters here */
+void
+_mish_filter_forget(
+		mish_p m,
+		uint64_t seq)
+{
+}
+
+/* what a line with \r in it ends up as, like a terminal would show it */
+static int
+_test_collapse()
+{
+	struct { const char * in, * out; int changed; } cr[] = {
+		{ "abc\n", "abc\n", 0 },
+		{ "abc\r\n", "abc\r\n", 0 },
+		{ "10%\r20%\r30%\n", "30%\n", 1 },
+		{ "10%\r20%\r30%\r\n", "30%\r\n", 1 },
+		{ "10%\r20%\r", "20%\r", 1 },
+		{ "hello world\rbye\n", "byelo world\n", 1 },
+		{ "hello\rhello world\n", "hello world\n", 1 },
+		{ "hello world\r\033[Kbye\n", "bye\n", 1 },
+		{ "hello world\r\033[2Kbye\n", "bye\n", 1 },
+		{ "hello world\rbye\033[K\n", "bye\n", 1 },
+		{ "hello world\rbye\033[0K\n", "bye\n", 1 },
+		{ "\033[1mhello world\rbye\n", "bye\n", 1 },
+		{ "hello world\r\033[1mbye\n", "\033[1mbye\n", 1 },
+		// unfinished, the cursor is after 'bye'
+		{ "hello world\rbye", "byelo world\rbye", 1 },
+	};
+	int bad = 0;
+	for (int i = 0; i < sizeof(cr) / sizeof(cr[0]); i++) {
+		uint8_t line[64];
+		size_t len = strlen(cr[i].in);
+		memcpy(line, cr[i].in, len);
+		int changed = _mish_input_collapse(line, &len);
+		if (changed != cr[i].changed || len != strlen(cr[i].out) ||
+				memcmp(line, cr[i].out, len)) {
+			printf("FAIL: collapse #%d gave '%.*s' (%d)\n", i,
+					(int)len, line, changed);
+			bad++;
+		}
+	}
+	/* the same, but the line is read in two parts */
+	struct { const char * in, * more, * out; } split[] = {
+		{ "abc\rX", "Y\n", "XYc\n" },
+		{ "abc\rX\r", "Y\n", "Ybc\n" },
+		{ "abc\r", "XY\n", "XYc\n" },
+		{ "10%\r20", "%\r30%\n", "30%\n" },
+		{ "hello world\rbye", "\033[K\n", "bye\n" },
+		{ "hello world\rbye", " you\n", "bye youorld\n" },
+	};
+	for (int i = 0; i < sizeof(split) / sizeof(split[0]); i++) {
+		uint8_t line[64];
+		size_t len = strlen(split[i].in);
+		memcpy(line, split[i].in, len);
+		_mish_input_collapse(line, &len);
+		memcpy(line + len, split[i].more, strlen(split[i].more));
+		len += strlen(split[i].more);
+		_mish_input_collapse(line, &len);
+		if (len != strlen(split[i].out) || memcmp(line, split[i].out, len)) {
+			printf("FAIL: split collapse #%d gave '%.*s'\n", i,
+					(int)len, line);
+			bad++;
+		}
+	}
+	printf("collapse: %d errors\n", bad);
+	return bad;
+}
 
 int main()
 {
+	if (_test_collapse())
+		exit(1);
+
 	const char *filen = "/usr/share/dict/american-english";
 	struct stat st;
 	int fd;
@@ -83,7 +168,7 @@ int main()
 	mish_p m = &mish;
 	FD_ZERO(&m->select.read);
 	FD_ZERO(&m->select.write);
-	TAILQ_INIT(&m->backlog.log);
+	_mish_backlog_init(&m->backlog);
 	TAILQ_INIT(&m->clients);
 
 	/* we don't need the file descriptor as we bypass "read" but the
@@ -108,7 +193,7 @@ int main()
 	 * well, they should match exactly.
 	 */
 	do {
-		_mish_input_read(m, &m->select.read, &input);
+		_mish_input_read(m, &input);
 		printf("  read up to o: %d/%d\n", (int)words_offset, (int)words_size);
 
 		if (!ln)
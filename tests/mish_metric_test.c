@@ -0,0 +1,91 @@
+/*
+ * mish_metric_test.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include "../src/mish_metric.c"
+
+/* only the text the regex needs is tested, none of these are called */
+uint64_t
+_mish_stamp_ms()
+{
+	return 0;
+}
+
+int
+_mish_filter_regexec(
+		regex_t * re,
+		const char * text,
+		size_t len,
+		size_t nmatch,
+		regmatch_t * match)
+{
+	return 0;
+}
+
+void
+_mish_trigger_print_text(
+		const char * text,
+		size_t at)
+{
+}
+
+void
+_mish_trigger_print_split(
+		FILE * f,
+		const char * line,
+		const char * const * text,
+		unsigned int count)
+{
+}
+
+char *
+_mish_trigger_unquote(
+		const char * a)
+{
+	return strdup(a);
+}
+
+int main()
+{
+	/* the text any line the regex matches has to have, "" is none */
+	struct { const char * re, * text; } t[] = {
+		{ "error", "error" },
+		{ "colou?r", "colo" },
+		{ "a(b|c)d", "a" },
+		{ "x(yz|w)zzz", "zzz" },
+		{ "x|y", "" },
+		{ "(x|y)", "" },
+		{ "[]a]bc", "bc" },
+		{ "[^]a]bc", "bc" },
+		{ "[[:digit:]]+ms", "ms" },
+		{ "[abc", "" },
+		{ "foo\\.bar", "foo" },
+		{ "\\(done\\)", "done" },
+		{ "ab{2}", "a" },
+		{ "x{10}", "" },
+		{ "ab{2,3}cd", "cd" },
+		{ "a*bc", "bc" },
+		{ "ab*c", "a" },
+		{ "ab+c", "ab" },
+		{ "^time: ([0-9.]+)s$", "time: " },
+		{ "rate=([0-9]+)/s", "rate=" },
+		{ ".*", "" },
+	};
+	int bad = 0;
+	for (int i = 0; i < sizeof(t) / sizeof(t[0]); i++) {
+		char * text = _mish_metric_text(t[i].re);
+		if (strcmp(text, t[i].text)) {
+			printf("FAIL: '%s' gave '%s', not '%s'\n", t[i].re, text,
+					t[i].text);
+			bad++;
+		}
+		free(text);
+	}
+	printf("metric texts: %d errors\n", bad);
+	return bad != 0;
+}
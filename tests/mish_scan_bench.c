@@ -0,0 +1,129 @@
+/*
+ * mish_scan_bench.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "mish_bench.h"
+#include "../src/mish_scan.c"
+
+/*
+ * Microbenchmark for the end of line scanners used on the captured output.
+ * The buffer is made of 'log like' lines, 20 to 120 characters, and each
+ * scanner is timed finding all the lines in it. The 'bytewise' one is what
+ * the generic input parser does, one character at a time, for reference.
+ * The substring search used by the backlog search is timed on the same
+ * buffer.
+ */
+#define BENCH_SIZE	(64 * 1024 * 1024)
+#define BENCH_LOOPS	8
+
+static const uint8_t *
+_bench_scan_bytewise(
+		const uint8_t * s,
+		const uint8_t * e)
+{
+	for (; s < e; s++)
+		if (*s == '\n')
+			return s;
+	return NULL;
+}
+
+// the AVX2 ones would die with SIGILL on a CPU that doesn't have it
+static int
+_bench_supported(
+		const char * name)
+{
+#ifdef MISH_SCAN_X86
+	__builtin_cpu_init();
+	if (!strcmp(name, "avx2") && !__builtin_cpu_supports("avx2")) {
+		printf("bench=scan impl=%s skipped, not supported\n", name);
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+static void
+_bench_run(
+		const char * name,
+		const uint8_t * (*scan)(const uint8_t * s, const uint8_t * e),
+		const uint8_t * buf,
+		size_t size)
+{
+	size_t lines = 0;
+	double start = bench_now();
+	for (int i = 0; i < BENCH_LOOPS; i++) {
+		const uint8_t * p = buf, * e = buf + size, * nl;
+		while ((nl = scan(p, e)) != NULL) {
+			lines++;
+			p = nl + 1;
+		}
+	}
+	double t = bench_now() - start;
+	printf("bench=scan_nl impl=%s lines=%zu bytes=%zu seconds=%.3f GBps=%.2f\n",
+			name, lines / BENCH_LOOPS, size, t,
+			((double)size * BENCH_LOOPS) / t / 1e9);
+}
+
+static void
+_bench_find(
+		const char * name,
+		const uint8_t * (*find)(const uint8_t * s, const uint8_t * e,
+				const uint8_t * n, size_t l),
+		const uint8_t * buf,
+		size_t size,
+		const char * needle)
+{
+	size_t hits = 0, l = strlen(needle);
+	double start = bench_now();
+	for (int i = 0; i < BENCH_LOOPS; i++) {
+		const uint8_t * p = buf, * e = buf + size;
+		while ((p = find(p, e, (const uint8_t *)needle, l)) != NULL) {
+			hits++;
+			p += l;
+		}
+	}
+	double t = bench_now() - start;
+	printf("bench=scan_find impl=%s needle='%s' hits=%zu bytes=%zu "
+			"seconds=%.3f GBps=%.2f\n",
+			name, needle, hits / BENCH_LOOPS, size, t,
+			((double)size * BENCH_LOOPS) / t / 1e9);
+}
+
+int main()
+{
+	uint8_t * buf = malloc(BENCH_SIZE);
+	const char * words[] = { "mish:", "connected", "value", "0x1f2e",
+			"[INFO]", "request", "took", "12ms", "=", "error", "foo/bar.c:42" };
+	size_t o = 0;
+	srandom(42);
+	while (o < BENCH_SIZE - 200) {
+		int l = 20 + (random() % 100);
+		int start = o;
+		while (o - start < l) {
+			const char * w = words[random() % (sizeof(words) / sizeof(words[0]))];
+			while (*w)
+				buf[o++] = *w++;
+			buf[o++] = ' ';
+		}
+		buf[o++] = '\n';
+	}
+	_bench_run("bytewise", _bench_scan_bytewise, buf, o);
+	for (int i = 0; _mish_scan_nl_impl[i].name; i++)
+		if (_bench_supported(_mish_scan_nl_impl[i].name))
+			_bench_run(_mish_scan_nl_impl[i].name,
+					_mish_scan_nl_impl[i].scan, buf, o);
+	const char * needles[] = { "error foo", "took 12ms = value", NULL };
+	for (int n = 0; needles[n]; n++)
+		for (int i = 0; _mish_scan_find_impl[i].name; i++)
+			if (_bench_supported(_mish_scan_find_impl[i].name))
+				_bench_find(_mish_scan_find_impl[i].name,
+						_mish_scan_find_impl[i].find, buf, o, needles[n]);
+	free(buf);
+	return 0;
+}
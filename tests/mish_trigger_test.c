@@ -0,0 +1,154 @@
+/*
+ * mish_trigger_test.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include "../src/mish_trigger.c"
+
+/*
+ * The triggers' commands are their number, so each call counts one for it;
+ * the metric is 'm'.
+ */
+static int fired[10];
+
+int
+mish_cmd_call(
+		const char * cmd_line,
+		void * c)
+{
+	fired[atoi(cmd_line)]++;
+	return 0;
+}
+
+uint64_t
+_mish_stamp_ms()
+{
+	return 0;
+}
+
+int
+_mish_filter_regexec(
+		regex_t * re,
+		const char * text,
+		size_t len,
+		size_t nmatch,
+		regmatch_t * match)
+{
+	while (len && (text[len - 1] == '\n' || text[len - 1] == '\r'))
+		len--;
+	char * l = strndup(text, len);
+	int res = regexec(re, l, nmatch, match, 0) == 0;
+	free(l);
+	return res;
+}
+
+void
+_mish_metric_line(
+		mish_metric_p e,
+		const char * text,
+		size_t len)
+{
+	e->count++;
+}
+
+// 'trigger' followed by 'args', they're split on spaces
+static void
+_test_cmd(
+		mish_client_p c,
+		const char * args)
+{
+	char line[128];
+	const char * argv[16] = { "trigger" };
+	int argc = 1;
+
+	snprintf(line, sizeof(line), "%s", args);
+	for (char * a = strtok(line, " "); a; a = strtok(NULL, " "))
+		argv[argc++] = a;
+	_mish_cmd_trigger(c, argc, argv);
+}
+
+/* the triggers that fired for 'line', by number, then the metric */
+static int
+_test_line(
+		mish_p m,
+		const char * line,
+		const char * want)
+{
+	char got[32] = "";
+	int l = 0;
+
+	memset(fired, 0, sizeof(fired));
+	m->metric.m[0].count = 0;
+	_mish_trigger_line(m, line, strlen(line));
+	for (int i = 0; i < 10; i++)
+		for (int j = 0; j < fired[i]; j++)
+			got[l++] = '0' + i;
+	for (int j = 0; j < m->metric.m[0].count; j++)
+		got[l++] = 'm';
+	got[l] = 0;
+	if (strcmp(got, want)) {
+		printf("FAIL: '%.*s' fired '%s', not '%s'\n",
+				(int)strcspn(line, "\n"), line, got, want);
+		return 1;
+	}
+	return 0;
+}
+
+int main()
+{
+	mish_t mish = {};
+	mish_client_t client = { .mish = &mish };
+	mish_p m = &mish;
+	mish_client_p c = &client;
+	int bad = 0;
+
+	// overlapping ones, suffixes of others, and the same text twice
+	_test_cmd(c, "-e 0 he 1");
+	_test_cmd(c, "-e 0 she 2");
+	_test_cmd(c, "-e 0 his 3");
+	_test_cmd(c, "-e 0 hers 4");
+	_test_cmd(c, "-e 0 he 5");
+	_test_cmd(c, "-e 0 e 6");
+	_test_cmd(c, "-e 0 -r ^h.*x$ x 7");
+	// the metrics come after the triggers in the automaton
+	m->metric.m[0].text = (char *)"rs";
+	m->metric.count = 1;
+
+	struct { const char * line, * want; } t[] = {
+		{ "ushers\n", "12456m" },
+		{ "his hershey\n", "123456m" },
+		{ "hhhe\n", "156" },
+		{ "nothing\n", "" },
+		{ "eeee\n", "6" },
+		{ "\n", "" },
+		{ "\xff\xfe he \xff\n", "156" },
+		{ "hiss\n", "3" },
+		{ "sh\n", "" },
+		{ "hex\n", "1567" },
+		{ "she sells hex\n", "1256" },
+	};
+	for (int i = 0; i < sizeof(t) / sizeof(t[0]); i++)
+		bad += _test_line(m, t[i].line, t[i].want);
+	// a line that matches isn't special to the next one
+	bad += _test_line(m, "he\n", "156");
+	bad += _test_line(m, "he\n", "156");
+
+	// remove the first 'he', then the other one; they're numbered again
+	_test_cmd(c, "-d 1");
+	bad += _test_line(m, "ushers\n", "2456m");
+	bad += _test_line(m, "hhhe\n", "56");
+	_test_cmd(c, "-d 4");
+	bad += _test_line(m, "ushers\n", "246m");
+	bad += _test_line(m, "hhhe\n", "6");
+	bad += _test_line(m, "his hershey\n", "2346m");
+	// there isn't a 7th one anymore
+	_test_cmd(c, "-d 7");
+	bad += _test_line(m, "hex\n", "67");
+
+	printf("triggers: %d errors\n", bad);
+	return bad != 0;
+}
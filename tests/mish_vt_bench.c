@@ -0,0 +1,185 @@
+/*
+ * mish_vt_bench.c
+ *
+ * Copyright (C) 2020 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "mish_bench.h"
+#include "../src/mish_vt.c"
+
+/*
+ * Microbenchmark for the VT decoder, counting the glyphs in a buffer of
+ * 'terminal like' text; 'log' is mostly plain text, with a colored tag
+ * and the odd UTF8 glyph, 'color' is a worse case with a lot more of both.
+ * 'switch' is the previous, byte at a time state machine, kept here for
+ * reference; 'table' is the current one, still a byte at a time, and
+ * 'span' is _mish_vt_glyph_count() that skips the runs of plain text.
+ */
+#define BENCH_SIZE	(32 * 1024 * 1024)
+#define BENCH_LOOPS	4
+
+static int
+_bench_vt_switch(
+		mish_vt_sequence_p s,
+		uint8_t ch)
+{
+	if (s->done)
+		s->flags = s->seq = s->glyph = s->pc = s->p[0] = 0;
+	switch (s->seq) {
+		case MISH_VT_RAW: {
+			switch (ch) {
+				case 0x1b:
+					s->seq = MISH_VT_ESC;
+					break;
+				default: {
+					if (ch & 0x80) {
+						int mask = 0x40;
+						s->seq_want = 0;
+						while ((ch & mask) && s->seq_want < 5) {
+							s->seq_want++;
+							mask >>= 1;
+						}
+						s->glyph = ch & (0xff >> (s->seq_want + 1));
+						s->seq = MISH_VT_UTF8;
+					} else {
+						s->seq = (s->seq << 8) | ch;
+						s->glyph = ch;
+						s->done = 1;
+					}
+				}
+			}
+		}	break;
+		case MISH_VT_ESC: {
+			if (ch == '[')
+				s->seq = MISH_VT_CSI;
+			else {
+				s->seq = (s->seq << 8) | ch;
+				s->done = 1;
+			}
+		}	break;
+		case MISH_VT_CSIQ:
+		case MISH_VT_CSI: {
+			switch (ch) {
+				case '?': {
+					if ((s->seq == MISH_VT_CSIQ) || s->pc) {
+						s->done = s->error = 1;
+					} else
+						s->seq = MISH_VT_CSIQ;
+				}	break;
+				case '0' ... '9':
+					s->p[s->pc] = (s->p[s->pc] * 10) + (ch - '0');
+					break;
+				case ';': {
+					if (s->pc + 1 < ARRAY_SIZE(s->p)) {
+						s->pc++;
+						s->p[s->pc] = 0;
+					} else {
+						s->done = s->error = 1;
+					}
+				}	break;
+				default:
+					if (s->p[s->pc])
+						s->pc++;
+					s->seq = (s->seq << 8) | ch;
+					s->done = 1;
+					break;
+			}
+		}	break;
+		case MISH_VT_UTF8: {
+			s->glyph = (s->glyph << 6) | (ch & 0x3f);
+			if (s->seq_want) s->seq_want--;
+			s->done = s->seq_want == 0;
+		}	break;
+	}
+	return s->done;
+}
+
+static void
+_bench_run(
+		const char * data,
+		const char * name,
+		int (*decode)(mish_vt_sequence_p s, uint8_t ch),
+		const char * buf,
+		size_t size)
+{
+	size_t glyphs = 0;
+	double start = bench_now();
+	for (int i = 0; i < BENCH_LOOPS; i++) {
+		mish_vt_sequence_t sq = {};
+		if (decode) {
+			for (size_t o = 0; o < size; o++)
+				if (decode(&sq, buf[o]) && sq.glyph)
+					glyphs++;
+		} else
+			glyphs += _mish_vt_glyph_count(&sq, buf, size);
+	}
+	double t = bench_now() - start;
+	printf("bench=vt data=%s impl=%s glyphs=%zu bytes=%zu seconds=%.3f "
+			"MBps=%.1f\n",
+			data, name, glyphs / BENCH_LOOPS, size, t,
+			((double)size * BENCH_LOOPS) / t / 1e6);
+}
+
+/*
+ * Fill 'buf' with lines of random words; 'tag' starts each line, if any
+ */
+static size_t
+_bench_fill(
+		char * buf,
+		const char * tag,
+		const char ** words,
+		int count)
+{
+	size_t o = 0;
+	srandom(42);
+	while (o < BENCH_SIZE - 200) {
+		int l = 20 + (random() % 100);
+		size_t start = o;
+		for (const char * w = tag; w && *w; w++)
+			buf[o++] = *w;
+		while (o - start < l) {
+			const char * w = words[random() % count];
+			while (*w)
+				buf[o++] = *w++;
+			buf[o++] = ' ';
+		}
+		buf[o++] = '\r';
+		buf[o++] = '\n';
+	}
+	return o;
+}
+
+int main()
+{
+	char * buf = malloc(BENCH_SIZE);
+	// a typical log; a colored tag per line, and the odd UTF8 glyph
+	const char * log[] = { "mish:", "connected", "value", "0x1f2e",
+			"request", "took", "12ms", "=", "foo/bar.c:42", "from",
+			"the", "client", "returned", "status", "200", "in", "queue",
+			"caf\xc3\xa9" };
+	// lots of colors and UTF8, that's the worst case for the spans
+	const char * color[] = { "mish:", "connected", "value", "0x1f2e",
+			"\033[1mbold\033[0m", "request", "took", "12ms", "=",
+			"\033[38;5;125merror\033[0m", "foo/bar.c:42", "caf\xc3\xa9",
+			"\xe2\x86\x92" };
+	struct {
+		const char * name, * tag, ** words;
+		int count;
+	} data[] = {
+		{ "log", "\033[32mINFO\033[0m ", log, ARRAY_SIZE(log) },
+		{ "color", NULL, color, ARRAY_SIZE(color) },
+	};
+	for (int i = 0; i < (int)ARRAY_SIZE(data); i++) {
+		size_t o = _bench_fill(buf, data[i].tag,
+						data[i].words, data[i].count);
+		_bench_run(data[i].name, "switch", _bench_vt_switch, buf, o);
+		_bench_run(data[i].name, "table", _mish_vt_sequence_char, buf, o);
+		_bench_run(data[i].name, "span", NULL, buf, o);
+	}
+	free(buf);
+	return 0;
+}
@@ -11,6 +11,34 @@
 #include <stdio.h>
 #include "../src/mish_vt.c"
 
+static int
+_test_utf8(
+		uint32_t cp)
+{
+	uint8_t b[4];
+	int l = 0;
+	if (cp < 0x80)
+		b[l++] = cp;
+	else if (cp < 0x800) {
+		b[l++] = 0xc0 | (cp >> 6);
+		b[l++] = 0x80 | (cp & 0x3f);
+	} else if (cp < 0x10000) {
+		b[l++] = 0xe0 | (cp >> 12);
+		b[l++] = 0x80 | ((cp >> 6) & 0x3f);
+		b[l++] = 0x80 | (cp & 0x3f);
+	} else {
+		b[l++] = 0xf0 | (cp >> 18);
+		b[l++] = 0x80 | ((cp >> 12) & 0x3f);
+		b[l++] = 0x80 | ((cp >> 6) & 0x3f);
+		b[l++] = 0x80 | (cp & 0x3f);
+	}
+	mish_vt_sequence_t sq = {};
+	for (int i = 0; i < l; i++)
+		if (_mish_vt_sequence_char(&sq, b[i]) != (i == l - 1))
+			return -1;
+	return sq.error || sq.glyph != cp ? -1 : 0;
+}
+
 /* small test unit for the VT decoder, mostly for UTF8 */
 int main()
 {
@@ -30,4 +58,39 @@ int main()
 		s++;
 	}
 	printf("%d glyphs in string\n", cg);
+	mish_vt_sequence_t sp = {};
+	if (_mish_vt_glyph_count(&sp, input, strlen(input)) != cg) {
+		printf("FAIL: glyph count of the span doesn't match\n");
+		exit(1);
+	}
+	// all the valid code points decode, surrogates don't; ESC isn't a glyph
+	int bad = 0;
+	for (uint32_t cp = 1; cp < 0x110000; cp++)
+		if (cp != 0x1b && (cp >= 0xd800 && cp < 0xe000) != (_test_utf8(cp) != 0))
+			bad++;
+	const char * invalid[] = { "\xc0\x80", "\xe0\x80\x80", "\xf5\x80\x80\x80",
+			"\xed\xa0\x80", "\x80", NULL };
+	for (int i = 0; invalid[i]; i++) {
+		mish_vt_sequence_t iv = {};
+		for (const char * p = invalid[i]; *p; p++)
+			if (_mish_vt_sequence_char(&iv, *p))
+				break;
+		if (!iv.error || iv.glyph != 0xfffd)
+			bad++;
+	}
+	// display width; escapes don't count, wide glyphs are two columns
+	struct { const char * s; unsigned int w; } width[] = {
+		{ input, 14 }, { "caf\xc3\xa9\r\n", 4 }, { "\xe6\x97\xa5\xe6\x9c\xac", 4 },
+		{ "e\xcc\x81", 1 }, { "a\tb", 9 }, { "\033[38;5;125m\033[0m", 0 },
+	};
+	for (int i = 0; i < sizeof(width) / sizeof(width[0]); i++) {
+		unsigned int w = _mish_vt_display_width(width[i].s, strlen(width[i].s));
+		if (w != width[i].w) {
+			printf("FAIL: width of '%s' is %u, not %u\n", width[i].s, w,
+					width[i].w);
+			bad++;
+		}
+	}
+	printf("utf8: %d errors\n", bad);
+	return bad != 0;
 }